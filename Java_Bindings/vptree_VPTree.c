@@ -643,12 +643,23 @@ Java_vptree_VPTree_knn(JNIEnv* env, jobject this, jobject datapoint, jlong k) {
 
     JVPT_READ_LOCK;
 
-    // Do the knn
+    // Do the knn. There can't be more results than items in the tree, and k 
+    // can be huge, so don't put the results on the stack.
     size_t num_found;
-    VPEntry knns[k];
     VPTree* vpt = &(jvpt->vpt);
-    VPT_knn(vpt, -1, (size_t)k, knns, &num_found);
-    if (!num_found) return NULL;
+    size_t max_found = min((size_t)k, VPT_size(vpt));
+    VPEntry* knns = (VPEntry*)malloc(max(max_found, 1) * sizeof(VPEntry));
+    if (!knns || !VPT_knn(vpt, -1, max_found, knns, &num_found)) {
+        free(knns);
+        JVPT_READ_UNLOCK;
+        throwOOM(env, "Ran out of memory searching the tree.");
+        return NULL;
+    }
+    if (!num_found) {
+        free(knns);
+        JVPT_READ_UNLOCK;
+        return NULL;
+    }
     ext_printf("C knn completed. Found %zu knns.\n", num_found);
 
     jsize array_size = (jsize)num_found;
@@ -666,6 +677,7 @@ Java_vptree_VPTree_knn(JNIEnv* env, jobject this, jobject datapoint, jlong k) {
         (*env)->SetObjectArrayElement(env, knn_arr, i, new_entry);
     }
     ext_printf("Filled the array with the entries that were found.\n");
+    free(knns);
 
     JVPT_READ_UNLOCK;
 
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define VECDIM 64
+#include "../vec.h"
+
+#define NUM_VECS 4096
+#define NUM_ROUNDS 50
+#define NUM_REPEATS 10
+
+static inline double
+randfrom(double min, double max) {
+    double range = (max - min);
+    double div = RAND_MAX / range;
+    return min + (rand() / div);
+}
+
+static inline float
+timedifference_msec(struct timeval t0, struct timeval t1) {
+    return (t1.tv_sec - t0.tv_sec) * 1000.0f + (t1.tv_usec - t0.tv_usec) / 1000.0f;
+}
+
+// Times every pair of vecs some rounds apart, many times over, and returns 
+// the fastest time of any repeat in ms, since a benchmark is only ever slowed 
+// down by noise. The distances are summed so that they can't be optimized out.
+static inline float
+time_distances(VEC* vecs, VECF* vecfs, double* sum) {
+    float best = 0;
+    for (size_t repeat = 0; repeat < NUM_REPEATS; repeat++) {
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        for (size_t round = 0; round < NUM_ROUNDS; round++) {
+            for (size_t i = 0; i < NUM_VECS; i++) {
+                size_t j = (i + round + 1) % NUM_VECS;
+                *sum += vecs ? VEC_distance(NULL, vecs[i], vecs[j]) : VECF_distance(NULL, vecfs[i], vecfs[j]);
+            }
+        }
+        gettimeofday(&end, NULL);
+        float msec = timedifference_msec(start, end);
+        if (!repeat || msec < best) best = msec;
+    }
+    return best;
+}
+
+int main() {
+    // Construct data, and a single precision copy of it
+    srand(0);
+    VEC* vecs = malloc(sizeof(VEC) * NUM_VECS);
+    VECF* vecfs = malloc(sizeof(VECF) * NUM_VECS);
+    double* expected = malloc(sizeof(double) * NUM_VECS);
+    for (size_t i = 0; i < NUM_VECS; i++) {
+        for (size_t j = 0; j < VECDIM; j++) {
+            vecs[i].data[j] = randfrom(-1.0, 1.0);
+        }
+        vecfs[i] = VEC_to_VECF(vecs[i]);
+    }
+
+    // Each kernel gets about the same distances as the scalar one.
+    VEC_use_kernel(VEC_KERNEL_SCALAR);
+    for (size_t i = 0; i < NUM_VECS; i++) expected[i] = VEC_distance(NULL, vecs[i], vecs[(i + 1) % NUM_VECS]);
+
+    printf("Best kernel: %s\n", VEC_kernel_name(VEC_best_kernel()));
+    for (int kernel = VEC_KERNEL_SCALAR; kernel <= VEC_KERNEL_NEON; kernel++) {
+        if (!VEC_use_kernel((VECKernel)kernel)) continue;
+
+        double max_error = 0, max_errorf = 0;
+        for (size_t i = 0; i < NUM_VECS; i++) {
+            double error = fabs(VEC_distance(NULL, vecs[i], vecs[(i + 1) % NUM_VECS]) - expected[i]) / expected[i];
+            double errorf = fabs(VECF_distance(NULL, vecfs[i], vecfs[(i + 1) % NUM_VECS]) - expected[i]) / expected[i];
+            if (error > max_error) max_error = error;
+            if (errorf > max_errorf) max_errorf = errorf;
+        }
+        if (max_error > 1e-12 || max_errorf > 1e-5) {
+            printf("The %s kernel is off by %g, or %g in single precision.\n",
+                   VEC_kernel_name((VECKernel)kernel), max_error, max_errorf);
+            return 1;
+        }
+
+        double sum = 0;
+        float msec = time_distances(vecs, NULL, &sum);
+        float msecf = time_distances(NULL, vecfs, &sum);
+        printf("%-7s %8.2f ns per VEC_distance(), %8.2f ns per VECF_distance() (%g)\n", VEC_kernel_name((VECKernel)kernel),
+               msec * 1e6f / (NUM_ROUNDS * NUM_VECS), msecf * 1e6f / (NUM_ROUNDS * NUM_VECS), sum);
+    }
+
+    free(expected);
+    free(vecfs);
+    free(vecs);
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define VECDIM 64
+#include "../vec.h"
+
+#define vpt_t VEC
+#define dist_t double
+#include "../vpt.h"
+
+#define NUM_DATAPOINTS 200000
+#define NUM_QUERIES 100
+#define K 10
+
+static inline double
+randfrom(double min, double max) {
+    double range = (max - min);
+    double div = RAND_MAX / range;
+    return min + (rand() / div);
+}
+
+static inline float
+timedifference_msec(struct timeval t0, struct timeval t1) {
+    return (t1.tv_sec - t0.tv_sec) * 1000.0f + (t1.tv_usec - t0.tv_usec) / 1000.0f;
+}
+
+// The fraction of the exact k nearest neighbors that the approximate search found. 
+// Results as close as the exact k-th neighbor count, so that ties don't matter.
+static inline double
+recall(VPEntry* exact, size_t num_exact, VPEntry* approx, size_t num_approx) {
+    if (!num_exact) return 1.0;
+    size_t found = 0;
+    for (size_t i = 0; i < num_approx; i++)
+        if (approx[i].distance <= exact[num_exact - 1].distance) found++;
+    return (double)found / num_exact;
+}
+
+int main() {
+    // Construct data
+    srand(0);
+    vpt_t* datapoints = malloc(sizeof(vpt_t) * NUM_DATAPOINTS);
+    vpt_t* queries = malloc(sizeof(vpt_t) * NUM_QUERIES);
+    for (size_t i = 0; i < NUM_DATAPOINTS; i++) {
+        for (size_t j = 0; j < VECDIM; j++) {
+            datapoints[i].data[j] = randfrom(-1.0, 1.0);
+        }
+    }
+    for (size_t i = 0; i < NUM_QUERIES; i++) {
+        for (size_t j = 0; j < VECDIM; j++) {
+            queries[i].data[j] = randfrom(-1.0, 1.0);
+        }
+    }
+
+    VPTree vpt;
+    VPT_build(&vpt, datapoints, NUM_DATAPOINTS, VEC_distance, NULL);
+
+    /*********/
+    /* Exact */
+    /*********/
+
+    VPEntry* exact = malloc(sizeof(VPEntry) * NUM_QUERIES * K);
+    size_t num_exact[NUM_QUERIES];
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for (size_t i = 0; i < NUM_QUERIES; i++)
+        VPT_knn(&vpt, queries[i], K, exact + i * K, num_exact + i);
+    gettimeofday(&end, NULL);
+    float exact_msec = timedifference_msec(start, end);
+    printf("Exact knn: %f ms per query.\n", exact_msec / NUM_QUERIES);
+
+    /***************/
+    /* Approximate */
+    /***************/
+
+    double epsilons[] = {0.0, 0.5, 1.0, 2.0, 4.0, 8.0};
+    size_t max_leaves[] = {0, 256, 64, 16};
+    VPEntry approx[K];
+    size_t num_approx;
+    printf("%8s %10s %10s %12s %8s\n", "epsilon", "max_leaves", "recall@k", "ms/query", "speedup");
+    for (size_t l = 0; l < sizeof(max_leaves) / sizeof(max_leaves[0]); l++) {
+        for (size_t e = 0; e < sizeof(epsilons) / sizeof(epsilons[0]); e++) {
+            double total_recall = 0;
+            gettimeofday(&start, NULL);
+            for (size_t i = 0; i < NUM_QUERIES; i++) {
+                VPT_knn_approx(&vpt, queries[i], K, epsilons[e], max_leaves[l], approx, &num_approx);
+                total_recall += recall(exact + i * K, num_exact[i], approx, num_approx);
+            }
+            gettimeofday(&end, NULL);
+            float msec = timedifference_msec(start, end);
+            printf("%8.2f %10zu %10.3f %12f %7.1fx\n", epsilons[e], max_leaves[l], 
+                   total_recall / NUM_QUERIES, msec / NUM_QUERIES, exact_msec / msec);
+        }
+    }
+
+    VPT_destroy(&vpt);
+    free(exact);
+    free(queries);
+    free(datapoints);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#define PRINT_STEPS 0
+
+#define MEMDEBUG 0
+#define PRINT_MEMALLOCS 0
+#include "../memdebug.h/memdebug.h"
+
+#define VPT_STATS
+#define vpt_t double
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../vpt.h"
+
+#define NUM_ITEMS 100000
+#define NUM_QUERIES 100
+#define K 10
+
+#define RMAX 50.0
+#define RMIN 0.0
+static inline double rand_zero_fifty() {
+    return RMIN + (rand() / (RAND_MAX / (RMAX - RMIN)));
+}
+
+#define abs(x) (((x) < 0) ? -(x) : (x))
+
+// Counts its own calls, to check the stats against.
+static size_t num_dist_calls = 0;
+double double_dist(void* extra_data, vpt_t d1, vpt_t d2) {
+    (void)extra_data;
+    num_dist_calls++;
+    return abs(d1 - d2);
+}
+
+static uint64_t hash_double(void* extra_data, vpt_t item) {
+    (void)extra_data;
+    uint64_t bits;
+    memcpy(&bits, &item, sizeof(bits));
+    return bits;
+}
+
+// Checks the stats of the last query, and adds them to the expected totals.
+static void check_query(VPTree* vpt, VPTQueryStats* expected) {
+    VPTQueryStats stats;
+    VPT_last_query_stats(&stats);
+    assert(stats.dist_calls == num_dist_calls);
+    assert(stats.branches_visited + stats.leaves_scanned + stats.subtrees_pruned == 2 * stats.branches_visited + 1);
+    // The queue of a best-first search can outgrow the depth-first stack.
+    if (!vpt->config.best_first) assert(stats.max_stack_depth <= vpt->height + 1);
+    num_dist_calls = 0;
+
+    expected->dist_calls += stats.dist_calls;
+    expected->branches_visited += stats.branches_visited;
+    expected->leaves_scanned += stats.leaves_scanned;
+    expected->subtrees_pruned += stats.subtrees_pruned;
+    if (stats.max_stack_depth > expected->max_stack_depth) expected->max_stack_depth = stats.max_stack_depth;
+}
+
+int main() {
+    srand(time(0));
+    vpt_t* data = malloc(NUM_ITEMS * sizeof(vpt_t));
+    for (size_t i = 0; i < NUM_ITEMS; i++) data[i] = rand_zero_fifty();
+
+    VPTConfig config = VPT_default_config();
+    config.leaf_size = 16;
+    config.small_tree_size = 0;
+    VPTree vpt;
+    bool success = VPT_build_config(&vpt, data, NUM_ITEMS, double_dist, NULL, &config);
+    assert(success);
+    num_dist_calls = 0;
+
+    // Each kind of query counts the same way.
+    VPTQueryStats expected = {0, 0, 0, 0, 0};
+    size_t num_queries = 0;
+    VPEntry results[K];
+    size_t num_results;
+    for (size_t i = 0; i < NUM_QUERIES; i++) {
+        vpt_t query = rand_zero_fifty();
+        vpt.config.best_first = i & 1;
+
+        success = VPT_knn(&vpt, query, K, results, &num_results);
+        assert(success && num_results == K);
+        check_query(&vpt, &expected);
+
+        success = VPT_nn(&vpt, query, results);
+        assert(success);
+        check_query(&vpt, &expected);
+
+        size_t count;
+        success = VPT_count_within(&vpt, query, 0.01, 0, &count);
+        assert(success);
+        check_query(&vpt, &expected);
+        num_queries += 3;
+    }
+
+    // A search that prunes visits much less than the tree.
+    VPTQueryStats stats;
+    VPT_last_query_stats(&stats);
+    assert(stats.subtrees_pruned);
+    assert(stats.dist_calls < NUM_ITEMS / 10);
+
+    // The tree's totals add up the queries.
+    size_t total_queries;
+    VPTQueryStats totals;
+    VPT_stats(&vpt, &total_queries, &totals);
+    assert(total_queries == num_queries);
+    assert(totals.dist_calls == expected.dist_calls);
+    assert(totals.branches_visited == expected.branches_visited);
+    assert(totals.leaves_scanned == expected.leaves_scanned);
+    assert(totals.subtrees_pruned == expected.subtrees_pruned);
+    assert(totals.max_stack_depth == expected.max_stack_depth);
+    if (PRINT_STEPS) {
+        printf("%zu queries: %zu distance calls, %zu branches, %zu leaves, %zu pruned, max stack %zu.\n",
+               total_queries, totals.dist_calls, totals.branches_visited, totals.leaves_scanned,
+               totals.subtrees_pruned, totals.max_stack_depth);
+    }
+
+    VPT_reset_stats(&vpt);
+    VPT_stats(&vpt, &total_queries, &totals);
+    assert(!total_queries && !totals.dist_calls);
+
+    // A query answered from the cache calculates no distances.
+    success = VPT_cache_init(&vpt, 1, hash_double) && VPT_nn(&vpt, 25.0, results);
+    assert(success);
+    num_dist_calls = 0;
+    success = VPT_nn(&vpt, 25.0, results);
+    assert(success && !num_dist_calls);
+
+    VPT_destroy(&vpt);
+    free(data);
+}
@@ -69,16 +69,33 @@ gen_entries(size_t num_entries) {
     return entries;
 }
 
+static inline int
+compare_dists(const void* a, const void* b) {
+    dist_t x = *(const dist_t*)a, y = *(const dist_t*)b;
+    return (x > y) - (x < y);
+}
+
 static inline bool
-knn_test(VPTree* vpt, vpt_t* query_point, size_t k) {
+knn_test(VPTree* vpt, vpt_t* query_point, size_t k, vpt_t* original_entries, size_t num_entries) {
     // knn
     size_t num_knns;
     VPEntry knns[k];
-    VPT_knn(vpt, *query_point, k, knns, &num_knns);
-    if (!num_knns) {
+    dist_t* dists = malloc(num_entries * sizeof(dist_t));
+    if (!dists || !VPT_knn(vpt, *query_point, k, knns, &num_knns) || !num_knns) {
+        free(dists);
         return false;
     }
 
+    // Now calculate it the normal way, and assert the distances are the same.
+    for (size_t i = 0; i < num_entries; i++) dists[i] = VEC_distance(NULL, *query_point, original_entries[i]);
+    qsort(dists, num_entries, sizeof(dist_t), compare_dists);
+    assert(num_knns == min(k, VPT_size(vpt)));
+    for (size_t i = 0; i < num_knns; i++) {
+        assert(knns[i].distance == dists[i]);
+        assert(VEC_distance(NULL, *query_point, knns[i].item) == knns[i].distance);
+    }
+    free(dists);
+
     // print results
     if (PRINT_STEPS) {
         printf("Finished KNN.\n");
@@ -87,6 +104,7 @@ knn_test(VPTree* vpt, vpt_t* query_point, size_t k) {
     }
 
     for (size_t i = 0; i < num_knns; i++) {
+        if (i) assert(knns[i - 1].distance <= knns[i].distance);
         if (PRINT_STEPS) {
             printf("dist: %f, ", knns[i].distance);
             print_VEC(&(knns[i].item));
@@ -97,6 +115,119 @@ knn_test(VPTree* vpt, vpt_t* query_point, size_t k) {
     return true;
 }
 
+static inline bool
+approx_test(VPTree* vpt, vpt_t* query_point, size_t k) {
+    // With no epsilon and no leaf limit, the approximate knn is exact.
+    size_t num_knns, num_approx;
+    VPEntry knns[k], approx[k];
+    bool success = VPT_knn(vpt, *query_point, k, knns, &num_knns)
+                && VPT_knn_approx(vpt, *query_point, k, 0.0, 0, approx, &num_approx);
+    if (success) {
+        assert(num_knns == num_approx);
+        for (size_t i = 0; i < num_knns; i++) assert(knns[i].distance == approx[i].distance);
+    }
+
+    // Otherwise, it still finds k.
+    if (success) success = VPT_knn_approx(vpt, *query_point, k, 1.0, 16, approx, &num_approx);
+    if (success) assert(num_approx == min(k, VPT_size(vpt)));
+    if (PRINT_STEPS) printf("Finished approximate KNN.\n");
+
+    free(query_point);
+    return success;
+}
+
+static inline bool
+first_below(void* user_data, vpt_t item) {
+    return item.data[0] < *(double*)user_data;
+}
+
+static inline bool
+filtered_test(VPTree* vpt, vpt_t* query_point, size_t k, vpt_t* original_entries) {
+    // Few enough items match that filtering a normal knn would miss some.
+    double max_first = 5.0;
+    size_t num_knns;
+    VPEntry knns[k];
+    bool success = VPT_knn_filtered(vpt, *query_point, k, first_below, &max_first, knns, &num_knns);
+
+    // The results all match, and no matching item was missed.
+    size_t num_matching = 0, num_closer = 0;
+    for (size_t i = 0; success && i < vpt->size; i++) {
+        if (!first_below(&max_first, original_entries[i])) continue;
+        num_matching++;
+        if (num_knns && VEC_distance(NULL, *query_point, original_entries[i]) < knns[num_knns - 1].distance)
+            num_closer++;
+    }
+    if (success) assert(num_knns == min(k, num_matching) && num_closer < k);
+    for (size_t i = 0; success && i < num_knns; i++) {
+        if (i) assert(knns[i - 1].distance <= knns[i].distance);
+        assert(first_below(&max_first, knns[i].item));
+        assert(VEC_distance(NULL, *query_point, knns[i].item) == knns[i].distance);
+    }
+    if (PRINT_STEPS) printf("Finished filtered KNN, %zu of %zu matching items.\n", num_knns, num_matching);
+
+    free(query_point);
+    return success;
+}
+
+static inline bool
+warm_test(VPTree* vpt, vpt_t* query_point, size_t k) {
+    size_t num_previous, num_knns, num_warm;
+    VPEntry previous[k], knns[k], warm[k];
+    bool success = VPT_knn(vpt, *query_point, k, previous, &num_previous);
+
+    // Starting from the results for a point nearby finds the same neighbors.
+    for (size_t j = 0; j < VECDIM; j++) query_point->data[j] += rand_zero_fifty() / 50.0;
+    if (success) success = VPT_knn(vpt, *query_point, k, knns, &num_knns)
+                        && VPT_knn_warm(vpt, *query_point, k, previous, num_previous, warm, &num_warm);
+    if (success) assert(num_warm == num_knns);
+    for (size_t i = 0; success && i < num_warm; i++) {
+        assert(warm[i].distance == knns[i].distance);
+        assert(VEC_distance(NULL, *query_point, warm[i].item) == warm[i].distance);
+    }
+    if (PRINT_STEPS) printf("Finished warm KNN.\n");
+
+    free(query_point);
+    return success;
+}
+
+static inline bool
+iterator_test(VPTree* vpt, vpt_t* query_point, size_t k) {
+    // The first k neighbors are the knn.
+    size_t num_knns;
+    VPEntry knns[k];
+    if (!VPT_knn(vpt, *query_point, k, knns, &num_knns)) {
+        free(query_point);
+        return false;
+    }
+
+    VPTNeighborIterator iter;
+    VPEntry neighbor;
+    bool found = true;
+    bool success = VPT_neighbors_init(&iter, vpt, *query_point);
+    for (size_t i = 0; success && i < num_knns; i++) {
+        success = VPT_neighbors_next(&iter, &neighbor, &found);
+        if (success) assert(found && neighbor.distance == knns[i].distance);
+    }
+
+    // Then the rest of the tree, in order.
+    size_t num_found = num_knns;
+    dist_t last = num_knns ? knns[num_knns - 1].distance : 0;
+    while (success && found) {
+        success = VPT_neighbors_next(&iter, &neighbor, &found);
+        if (success && found) {
+            assert(last <= neighbor.distance);
+            last = neighbor.distance;
+            num_found++;
+        }
+    }
+    if (success) assert(num_found == VPT_size(vpt));
+    VPT_neighbors_destroy(&iter);
+    if (PRINT_STEPS) printf("Iterated over %zu neighbors.\n", num_found);
+
+    free(query_point);
+    return success;
+}
+
 static inline bool
 nn_test(VPTree* vpt, vpt_t* query_point) {
     // nn
@@ -116,6 +247,276 @@ nn_test(VPTree* vpt, vpt_t* query_point) {
     return true;
 }
 
+struct EntryStream {
+    vpt_t* entries;
+    size_t num_entries;
+    size_t next;
+};
+
+static inline bool
+next_entry(void* stream, vpt_t* item) {
+    struct EntryStream* entry_stream = (struct EntryStream*)stream;
+    if (entry_stream->next == entry_stream->num_entries) return false;
+    *item = entry_stream->entries[entry_stream->next++];
+    return true;
+}
+
+static inline bool
+batch_test(VPTree* vpt, vpt_t* queries, size_t num_queries, size_t k, dist_t max_dist) {
+    VPEntry* knn_results = malloc(num_queries * k * sizeof(VPEntry));
+    VPEntry** within_results = malloc(num_queries * sizeof(VPEntry*));
+    size_t* num_results = malloc(num_queries * sizeof(size_t));
+    bool success = knn_results && within_results && num_results;
+
+    // Every query should get the same answer as it would by itself.
+    if (success) success = VPT_knn_batch(vpt, queries, num_queries, k, knn_results, num_results, 0);
+    for (size_t i = 0; success && i < num_queries; i++) {
+        VPEntry knns[k];
+        size_t num_knns;
+        success = VPT_knn(vpt, queries[i], k, knns, &num_knns);
+        assert(num_knns == num_results[i]);
+        for (size_t j = 0; j < num_knns; j++)
+            assert(knns[j].distance == knn_results[i * k + j].distance);
+    }
+
+    if (success) {
+        success = VPT_all_within_batch(vpt, queries, num_queries, max_dist, within_results, num_results, 0);
+        for (size_t i = 0; i < num_queries; i++) {
+            VPEntry* within = NULL;
+            size_t num_within;
+            if (success) success = VPT_all_within(vpt, queries[i], max_dist, &within, &num_within);
+            if (success) assert(num_within == num_results[i]);
+            free(within_results[i]);
+            free(within);
+        }
+    }
+    if (PRINT_STEPS) printf("Finished batch of %zu queries.\n", num_queries);
+
+    free(num_results);
+    free(within_results);
+    free(knn_results);
+    free(queries);
+    return success;
+}
+
+struct JoinCount {
+    atomic_size_t num_pairs;
+    dist_t max_dist;
+};
+
+static inline bool
+count_pair(void* user_data, vpt_t first, vpt_t second, dist_t distance) {
+    struct JoinCount* count = (struct JoinCount*)user_data;
+    assert(VEC_distance(NULL, first, second) == distance && distance <= count->max_dist);
+    atomic_fetch_add(&(count->num_pairs), 1);
+    return true;
+}
+
+static inline bool
+self_join_test(vpt_t* entries, size_t num_entries, dist_t max_dist, size_t mvp_fanout) {
+    VPTConfig config = VPT_default_config();
+    config.leaf_size = 10;
+    config.small_tree_size = 0;
+    config.leaf_distances = true;
+    config.mvp_fanout = mvp_fanout;
+    VPTree vpt;
+    bool success = VPT_build_config(&vpt, entries, num_entries, VEC_distance, NULL, &config);
+
+    // Every pair should be found exactly once.
+    struct JoinCount count;
+    atomic_init(&(count.num_pairs), 0);
+    count.max_dist = max_dist;
+    if (success) success = VPT_self_join(&vpt, max_dist, count_pair, &count, 4);
+    if (success) {
+        size_t num_pairs = 0;
+        for (size_t i = 0; i < num_entries; i++)
+            for (size_t j = i + 1; j < num_entries; j++)
+                if (VEC_distance(NULL, entries[i], entries[j]) <= max_dist) num_pairs++;
+        assert(atomic_load(&(count.num_pairs)) == num_pairs);
+        if (PRINT_STEPS) printf("Self join found %zu pairs within %f.\n", num_pairs, max_dist);
+    }
+
+    VPT_destroy(&vpt);
+    free(entries);
+    return success;
+}
+
+static inline bool
+knn_graph_test(vpt_t* entries, size_t num_entries, size_t k, size_t mvp_fanout, size_t leaf_size) {
+    VPTConfig config = VPT_default_config();
+    config.leaf_size = leaf_size;
+    config.small_tree_size = 0;
+    config.mvp_fanout = mvp_fanout;
+    VPTree vpt;
+    bool success = VPT_build_config(&vpt, entries, num_entries, VEC_distance, NULL, &config);
+
+    // Each item's neighbors should be its k + 1 nearest, less itself, 
+    // and each index should point to a different item that far away.
+    VPKnnGraph graph;
+    if (success) success = VPT_knn_graph(&vpt, k, &graph, 4);
+    if (success) {
+        assert(graph.num_items == num_entries && graph.k == k);
+        assert(graph.num_neighbor_items == num_entries && graph.neighbor_items == graph.items);
+        for (size_t i = 0; success && i < graph.num_items; i++) {
+            VPEntry knns[k + 1];
+            size_t num_knns;
+            success = VPT_knn(&vpt, graph.items[i], k + 1, knns, &num_knns);
+            assert(num_knns == k + 1 && knns[0].distance == 0);
+            for (size_t j = 0; j < k; j++) {
+                size_t index = graph.indices[i * k + j];
+                assert(graph.distances[i * k + j] == knns[j + 1].distance);
+                assert(index < graph.num_items && index != i);
+                assert(VEC_distance(NULL, graph.items[i], graph.items[index]) == graph.distances[i * k + j]);
+                for (size_t l = 0; l < j; l++) assert(graph.indices[i * k + l] != index);
+            }
+        }
+        VPT_knn_graph_destroy(&graph);
+        if (PRINT_STEPS) printf("Finished knn graph of %zu items.\n", num_entries);
+    }
+
+    VPT_destroy(&vpt);
+    free(entries);
+    return success;
+}
+
+struct JoinCheck {
+    atomic_size_t num_pairs;
+    dist_t max_dist;
+    vpt_t* queries;
+    size_t num_queries;
+};
+
+static inline bool
+check_pair(void* user_data, vpt_t query, vpt_t item, dist_t distance) {
+    struct JoinCheck* check = (struct JoinCheck*)user_data;
+    assert(VEC_distance(NULL, query, item) == distance && distance <= check->max_dist);
+
+    // The query has to come first.
+    bool is_query = false;
+    for (size_t i = 0; i < check->num_queries; i++) is_query |= VEC_equal(check->queries[i], query);
+    assert(is_query);
+    atomic_fetch_add(&(check->num_pairs), 1);
+    return true;
+}
+
+static inline bool
+join_test(vpt_t* queries, size_t num_queries, vpt_t* entries, size_t num_entries, size_t k, dist_t max_dist) {
+    VPTConfig config = VPT_default_config();
+    config.leaf_size = 10;
+    config.small_tree_size = 0;
+    VPTree query_vpt, vpt;
+    bool success = VPT_build_config(&query_vpt, queries, num_queries, VEC_distance, NULL, &config);
+    bool attempted_reference = success;
+    config.leaf_distances = true;
+    if (success) success = VPT_build_config(&vpt, entries, num_entries, VEC_distance, NULL, &config);
+
+    // Each query's neighbors should be the same as it would find by itself, 
+    // and each index should point to a reference item that far away.
+    VPKnnGraph graph;
+    if (success) success = VPT_knn_join(&query_vpt, &vpt, k, &graph, 4);
+    if (success) {
+        assert(graph.num_items == num_queries && graph.k == k);
+        assert(graph.num_neighbor_items == num_entries && graph.neighbor_items != graph.items);
+        for (size_t i = 0; success && i < graph.num_items; i++) {
+            VPEntry knns[k];
+            size_t num_knns;
+            success = VPT_knn(&vpt, graph.items[i], k, knns, &num_knns);
+            for (size_t j = 0; j < num_knns; j++) {
+                size_t index = graph.indices[i * k + j];
+                assert(graph.distances[i * k + j] == knns[j].distance);
+                assert(index < graph.num_neighbor_items);
+                assert(VEC_distance(NULL, graph.items[i], graph.neighbor_items[index]) == graph.distances[i * k + j]);
+            }
+        }
+        VPT_knn_graph_destroy(&graph);
+    }
+
+    // And every pair should be found exactly once.
+    struct JoinCheck check;
+    atomic_init(&(check.num_pairs), 0);
+    check.max_dist = max_dist;
+    check.queries = queries;
+    check.num_queries = num_queries;
+    if (success) success = VPT_join_within(&query_vpt, &vpt, max_dist, check_pair, &check, 4);
+    if (success) {
+        size_t num_pairs = 0;
+        for (size_t i = 0; i < num_queries; i++)
+            for (size_t j = 0; j < num_entries; j++)
+                if (VEC_distance(NULL, queries[i], entries[j]) <= max_dist) num_pairs++;
+        assert(atomic_load(&(check.num_pairs)) == num_pairs);
+        if (PRINT_STEPS) printf("Join found %zu pairs within %f.\n", num_pairs, max_dist);
+    }
+
+    // Free both trees even if something failed, since a failed build is safe 
+    // to destroy. The reference tree is only built if the query tree was.
+    VPT_destroy(&query_vpt);
+    if (attempted_reference) VPT_destroy(&vpt);
+    free(queries);
+    free(entries);
+    return success;
+}
+
+static inline uint64_t
+hash_VEC(void* extra_data, vpt_t item) {
+    (void)extra_data;
+    // FNV-1a over the bytes of the point
+    uint64_t hash = 14695981039346656037ULL;
+    unsigned char* bytes = (unsigned char*)&item;
+    for (size_t i = 0; i < sizeof(vpt_t); i++) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static inline bool
+cache_test(VPTree* vpt, vpt_t* queries, size_t num_queries, size_t k, dist_t max_dist) {
+    // Room for the knn, nn, and all_within results of every query.
+    bool success = VPT_cache_init(vpt, 3 * num_queries, hash_VEC);
+    VPEntry* knn_results = malloc(num_queries * k * sizeof(VPEntry));
+    size_t* num_results = malloc(num_queries * sizeof(size_t));
+    success = success && knn_results && num_results;
+
+    // The second time, every query is answered from the cache, the same way.
+    for (size_t round = 0; success && round < 2; round++) {
+        for (size_t i = 0; success && i < num_queries; i++) {
+            VPEntry knns[k], nn, *within = NULL;
+            size_t num_knns, num_within;
+            success = VPT_knn(vpt, queries[i], k, knns, &num_knns) && VPT_nn(vpt, queries[i], &nn)
+                   && VPT_all_within(vpt, queries[i], max_dist, &within, &num_within);
+            if (success) {
+                if (!round) num_results[i] = num_knns;
+                assert(num_knns == num_results[i] && nn.distance == knns[0].distance);
+                for (size_t j = 0; j < num_knns; j++) {
+                    if (!round) knn_results[i * k + j] = knns[j];
+                    assert(knns[j].distance == knn_results[i * k + j].distance);
+                }
+                for (size_t j = 0; j < num_within; j++) assert(within[j].distance <= max_dist);
+            }
+            free(within);
+        }
+    }
+    size_t hits, misses;
+    VPT_cache_stats(vpt, &hits, &misses);
+    if (success) assert(hits == 3 * num_queries && misses == 3 * num_queries);
+
+    // The least recently used results make way for new ones.
+    VPEntry nn;
+    if (success) success = VPT_cache_init(vpt, 1, hash_VEC);
+    if (success) success = VPT_nn(vpt, queries[0], &nn) && VPT_nn(vpt, queries[1], &nn)
+                        && VPT_nn(vpt, queries[0], &nn) && VPT_nn(vpt, queries[0], &nn);
+    VPT_cache_stats(vpt, &hits, &misses);
+    if (success) assert(hits == 1 && misses == 3);
+
+    // Rebuilding forgets the results of the old tree, but keeps the cache.
+    if (success) success = VPT_rebuild(vpt) && VPT_nn(vpt, queries[0], &nn);
+    VPT_cache_stats(vpt, &hits, &misses);
+    if (success) assert(hits == 1 && misses == 4);
+    if (PRINT_STEPS) printf("Finished cache of %zu queries.\n", num_queries);
+
+    free(num_results);
+    free(knn_results);
+    free(queries);
+    return success;
+}
+
 static inline bool
 add_rebuild_test(VPTree* vpt, vpt_t* to_add, size_t num_to_add) {
     bool success = VPT_add_rebuild(vpt, to_add, num_to_add);
@@ -127,7 +528,7 @@ add_rebuild_test(VPTree* vpt, vpt_t* to_add, size_t num_to_add) {
 }
 
 static inline bool
-all_within_test(VPTree* vpt, vpt_t* query, dist_t max_dist, vpt_t* original_entries) {
+all_within_test(VPTree* vpt, vpt_t* query, dist_t max_dist, vpt_t* original_entries, size_t num_entries) {
     // VPTree* vpt, vpt_t datapoint, dist_t max_dist, VPEntry** result_space, size_t* num_results
     VPEntry* result = NULL;
     size_t num_results = 0;
@@ -138,12 +539,21 @@ all_within_test(VPTree* vpt, vpt_t* query, dist_t max_dist, vpt_t* original_entr
 
     // Now calculate it the normal way, and assert the results are the same.
     size_t num_results_normal = 0;
-    for (int i = 0; i < NUM_ENTRIES; i++) {
+    for (size_t i = 0; i < num_entries; i++) {
         dist_t dist = VEC_distance(NULL, *query, original_entries[i]);
         if (dist <= max_dist) { num_results_normal++; }
     }
 
     assert(num_results == num_results_normal);
+    for (size_t i = 0; success && i < num_results; i++) 
+        assert(VEC_distance(NULL, *query, result[i].item) == result[i].distance && result[i].distance <= max_dist);
+
+    // Counting finds the same, and stops at the limit.
+    size_t count = 0;
+    if (success) success = VPT_count_within(vpt, *query, max_dist, 0, &count);
+    if (success) assert(count == num_results_normal);
+    if (success) success = VPT_count_within(vpt, *query, max_dist, 1, &count);
+    if (success) assert(count == min(1, num_results_normal));
 
     free(query);
     free(result);
@@ -170,19 +580,54 @@ int main() {
     }
 
     // knn
-    success = knn_test(&vpt, gen_entries(1), 20);
+    success = knn_test(&vpt, gen_entries(1), 20, entries, num_entries);
     if (!success) {
         printf("Ran out of memory during tree knn.\n");
         return 1;
     }
 
     // knn
-    success = knn_test(&vpt, gen_entries(1), 50);
+    success = knn_test(&vpt, gen_entries(1), 50, entries, num_entries);
+    if (!success) {
+        printf("Ran out of memory during tree knn.\n");
+        return 1;
+    }
+
+    // knn, with enough neighbors to use a heap
+    success = knn_test(&vpt, gen_entries(1), 2000, entries, num_entries);
     if (!success) {
         printf("Ran out of memory during tree knn.\n");
         return 1;
     }
 
+    // Approximate knn
+    success = approx_test(&vpt, gen_entries(1), 20);
+    if (!success) {
+        printf("Ran out of memory during approximate tree knn.\n");
+        return 1;
+    }
+
+    // Filtered knn
+    success = filtered_test(&vpt, gen_entries(1), 20, entries);
+    if (!success) {
+        printf("Ran out of memory during filtered tree knn.\n");
+        return 1;
+    }
+
+    // Warm knn, with and without a heap
+    success = warm_test(&vpt, gen_entries(1), 20) && warm_test(&vpt, gen_entries(1), 50);
+    if (!success) {
+        printf("Ran out of memory during warm tree knn.\n");
+        return 1;
+    }
+
+    // Nearest neighbor iterator
+    success = iterator_test(&vpt, gen_entries(1), 50);
+    if (!success) {
+        printf("Ran out of memory iterating over nearest neighbors.\n");
+        return 1;
+    }
+
     // nn
     success = nn_test(&vpt, gen_entries(1));
     if (!success) {
@@ -191,12 +636,41 @@ int main() {
     }
 
     // All Within
-    success = all_within_test(&vpt, gen_entries(1), 80.0, entries);
+    success = all_within_test(&vpt, gen_entries(1), 80.0, entries, num_entries);
     if (!success) {
         printf("Ran out of memory during tree all_within.\n");
         return 1;
     }
 
+    // Batch
+    success = batch_test(&vpt, gen_entries(100), 100, 20, 80.0);
+    if (!success) {
+        printf("Ran out of memory during tree batch queries.\n");
+        return 1;
+    }
+
+    // Self join
+    success = self_join_test(gen_entries(3000), 3000, 80.0, 0) && self_join_test(gen_entries(3000), 3000, 80.0, 2);
+    if (!success) {
+        printf("Ran out of memory during tree self join.\n");
+        return 1;
+    }
+
+    // All knn graph, including a tree that's one leaf too big to take the distances of all at once
+    success = knn_graph_test(gen_entries(3000), 3000, 10, 0, 10) && knn_graph_test(gen_entries(3000), 3000, 40, 2, 10)
+           && knn_graph_test(gen_entries(2000), 2000, 10, 0, 3000);
+    if (!success) {
+        printf("Ran out of memory during knn graph.\n");
+        return 1;
+    }
+
+    // Joins between two trees
+    success = join_test(gen_entries(1000), 1000, gen_entries(3000), 3000, 10, 80.0);
+    if (!success) {
+        printf("Ran out of memory during tree join.\n");
+        return 1;
+    }
+
     // Rebuild
     success = VPT_rebuild(&vpt);
     if (!success) {
@@ -204,6 +678,109 @@ int main() {
         return 1;
     }
 
+    // Parallel Rebuild
+    vpt.config.build_threads = 0;
+    success = VPT_rebuild(&vpt);
+    if (!success) {
+        printf("Ran out of memory rebuilding the tree in parallel.\n");
+        return 1;
+    }
+
+    // Rebuild keeping leaf distances
+    vpt.config.leaf_distances = true;
+    success = VPT_rebuild(&vpt);
+    if (!success) {
+        printf("Ran out of memory rebuilding the tree with leaf distances.\n");
+        return 1;
+    }
+    success = all_within_test(&vpt, gen_entries(1), 80.0, entries, num_entries);
+    if (!success) {
+        printf("Ran out of memory during tree all_within with leaf distances.\n");
+        return 1;
+    }
+
+    // Best-first knn and nn
+    vpt.config.best_first = true;
+    success = knn_test(&vpt, gen_entries(1), 20, entries, num_entries);
+    if (!success) {
+        printf("Ran out of memory during best-first tree knn.\n");
+        return 1;
+    }
+    success = nn_test(&vpt, gen_entries(1));
+    if (!success) {
+        printf("Ran out of memory during best-first tree nn.\n");
+        return 1;
+    }
+    success = filtered_test(&vpt, gen_entries(1), 20, entries);
+    if (!success) {
+        printf("Ran out of memory during best-first filtered tree knn.\n");
+        return 1;
+    }
+    vpt.config.best_first = false;
+
+    // Rebuild with multi-vantage-point branches
+    vpt.config.mvp_fanout = 3;
+    success = VPT_rebuild(&vpt);
+    if (!success) {
+        printf("Ran out of memory rebuilding the tree with multi-vantage-point branches.\n");
+        return 1;
+    }
+    success = knn_test(&vpt, gen_entries(1), 20, entries, num_entries) && approx_test(&vpt, gen_entries(1), 20)
+           && filtered_test(&vpt, gen_entries(1), 20, entries) && warm_test(&vpt, gen_entries(1), 20)
+           && iterator_test(&vpt, gen_entries(1), 50) && nn_test(&vpt, gen_entries(1))
+           && all_within_test(&vpt, gen_entries(1), 80.0, entries, num_entries);
+    if (!success) {
+        printf("Ran out of memory searching the tree with multi-vantage-point branches.\n");
+        return 1;
+    }
+    vpt.config.mvp_fanout = 0;
+
+    // Rebuild with each way of picking vantage points
+    vpt_t* cost_queries = gen_entries(10);
+    for (int strategy = VPT_VP_FIRST; strategy <= VPT_VP_FARTHEST_FROM_PARENT; strategy++) {
+        vpt.config.vp_strategy = (VPVantageStrategy)strategy;
+        success = VPT_rebuild(&vpt);
+        if (!success) {
+            printf("Ran out of memory rebuilding the tree with vantage point strategy %d.\n", strategy);
+            return 1;
+        }
+        success = knn_test(&vpt, gen_entries(1), 20, entries, num_entries)
+               && all_within_test(&vpt, gen_entries(1), 80.0, entries, num_entries);
+        if (!success) {
+            printf("Ran out of memory searching the tree with vantage point strategy %d.\n", strategy);
+            return 1;
+        }
+        double cost = VPT_knn_cost(&vpt, cost_queries, 10, 20);
+        if (PRINT_STEPS) {
+            printf("Vantage point strategy %d: %f distance calculations per knn.\n", strategy, cost);
+        }
+    }
+    free(cost_queries);
+
+    // Autotune, then rebuild with the tuned config
+    VPTConfig tuned;
+    success = VPT_autotune(entries, num_entries, VEC_distance, NULL, &(vpt.config), 1000, &tuned);
+    if (!success) {
+        printf("Ran out of memory autotuning the tree.\n");
+        return 1;
+    }
+    if (PRINT_STEPS) {
+        printf("Tuned leaf size: %zu, sort threshold: %zu.\n", tuned.leaf_size, tuned.sort_threshold);
+    }
+    vpt.config = tuned;
+    success = VPT_rebuild(&vpt);
+    if (!success) {
+        printf("Ran out of memory rebuilding the tree with the tuned config.\n");
+        return 1;
+    }
+
+    // Cache, which the tree keeps through the next rebuild
+    success = cache_test(&vpt, gen_entries(20), 20, 20, 80.0);
+    if (!success) {
+        printf("Ran out of memory during cached tree queries.\n");
+        return 1;
+    }
+
     // Add_Rebuild
     size_t num_new_entries = 10000;
     success = add_rebuild_test(&vpt, gen_entries(num_new_entries), num_new_entries);
@@ -212,6 +789,44 @@ int main() {
         return 1;
     }
 
+    VPT_destroy(&vpt);
+
+    // Streamed build, with only enough memory to build a quarter of it at a time.
+    struct EntryStream stream = {entries, 20000, 0};
+    size_t memory_budget = 5000 * (sizeof(vpt_t) + sizeof(VPBuildKey));
+    success = VPT_build_stream(&vpt, next_entry, &stream, VEC_distance, NULL, memory_budget, NULL);
+    if (!success) {
+        printf("Failed to build the tree from a stream.\n");
+        return 1;
+    }
+    assert(VPT_size(&vpt) == 20000);
+    success = knn_test(&vpt, gen_entries(1), 20, entries, 20000)
+           && all_within_test(&vpt, gen_entries(1), 80.0, entries, 20000);
+    if (!success) {
+        printf("Ran out of memory during streamed tree queries.\n");
+        return 1;
+    }
+    VPT_destroy(&vpt);
+
+    // Deep tree. Copies of the same point barely split, so this tree
+    // is far taller than VPT_MAX_HEIGHT.
+    size_t num_copies = 2000;
+    VPTConfig deep_config = VPT_default_config();
+    deep_config.leaf_size = 3;
+    deep_config.small_tree_size = 0;
+    for (size_t i = 1; i < num_copies; i++) entries[i] = entries[0];
+    success = VPT_build_config(&vpt, entries, num_copies, VEC_distance, NULL, &deep_config);
+    if (!success) {
+        printf("Ran out of memory building a deep tree.\n");
+        return 1;
+    }
+    if (PRINT_STEPS) printf("Deep tree height: %zu.\n", vpt.height);
+    success = knn_test(&vpt, gen_entries(1), 20, entries, num_copies);
+    if (!success) {
+        printf("Ran out of memory during deep tree knn.\n");
+        return 1;
+    }
+
     // Free the remaining memory
     VPT_destroy(&vpt);
     free(entries);
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "log.h"
 
@@ -21,12 +22,16 @@
 #define dist_max INFINITY
 #endif
 
+#ifndef vpt_idx_t
+#include <stdint.h>
+#define vpt_idx_t uint32_t
+#endif
 
-struct VPEntry {
-  vpt_t item;
+struct VPBuildKey {
   dist_t distance;
+  vpt_idx_t index;
 };
-typedef struct VPEntry VPEntry;
+typedef struct VPBuildKey VPBuildKey;
 #endif
 
 /********************/
@@ -34,26 +39,28 @@ typedef struct VPEntry VPEntry;
 /********************/
 #if DEBUG
 static inline void 
-assert_sorted(VPEntry *arr, size_t n) {
+assert_sorted(VPBuildKey *arr, size_t n) {
   for (size_t i = 1; i < n; i++) {
     assert(arr[i - 1].distance <= arr[i].distance);
   }
 }
 #else
 static inline void 
-assert_sorted(VPEntry *arr, size_t n) {
+assert_sorted(VPBuildKey *arr, size_t n) {
   (void)arr;
   (void)n;
 }
 #endif
 
+#define SORT_THRESHOLD 2000
+
 /**************/
 /* SHELL SORT */
 /**************/
 static inline void 
-shellsort(VPEntry *arr, size_t n) {
+shellsort(VPBuildKey *arr, size_t n) {
   size_t interval, i, j;
-  VPEntry temp;
+  VPBuildKey temp;
   for (interval = n / 2; interval > 0; interval /= 2) {
     for (i = interval; i < n; i += 1) {
       temp = arr[i];
@@ -67,96 +74,382 @@ shellsort(VPEntry *arr, size_t n) {
   }
 }
 
+/*************/
+/* SORT POOL */
+/*************/
+
+// Threads that stay alive between sorts, so that sorting a large list
+// doesn't cost a round of pthread_create() and pthread_join() each time. 
+// Create one with VPSortPool_create(), and share it between every call to 
+// VPSort() that should use it. Only one sort uses the pool at a time.
+// Any other sort that runs meanwhile runs on its own calling thread.
+struct VPSortPool {
+  pthread_mutex_t in_use;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t finished;
+  pthread_t *threads;
+  size_t num_threads;
+  bool shutdown;
+
+  // The batch of jobs currently being run.
+  void (*job_fn)(void *job);
+  char *jobs;
+  size_t job_size;
+  size_t num_jobs;
+  size_t next_job;
+  size_t jobs_done;
+};
+typedef struct VPSortPool VPSortPool;
+
+// Takes and runs jobs from the current batch until there are none left. 
+// Call with the pool's lock held. Returns with it still held.
+static inline void 
+__sortpool_work(VPSortPool *pool) {
+  while (pool->next_job < pool->num_jobs) {
+    char *job = pool->jobs + (pool->job_size * pool->next_job++);
+    pthread_mutex_unlock(&(pool->lock));
+    pool->job_fn(job);
+    pthread_mutex_lock(&(pool->lock));
+    if (++pool->jobs_done == pool->num_jobs)
+      pthread_cond_signal(&(pool->finished));
+  }
+}
+
+static void *__sortpool_thread(void *arg) {
+  VPSortPool *pool = (VPSortPool *)arg;
+  pthread_mutex_lock(&(pool->lock));
+  while (!pool->shutdown) {
+    __sortpool_work(pool);
+    if (!pool->shutdown)
+      pthread_cond_wait(&(pool->wake), &(pool->lock));
+  }
+  pthread_mutex_unlock(&(pool->lock));
+  return NULL;
+}
+
+/*
+ * Starts a pool that sorts with num_threads threads, counting the thread 
+ * that calls VPSort(). If num_threads is 0, uses one per online core.
+ * Returns false if the pool could not be created. 
+ */
+static inline bool 
+VPSortPool_create(VPSortPool *pool, size_t num_threads) {
+  if (!num_threads) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = online > 0 ? (size_t)online : 1;
+  }
+
+  pool->shutdown = false;
+  pool->num_jobs = pool->next_job = pool->jobs_done = 0;
+  pool->num_threads = 0;
+  pool->threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  if (!pool->threads) return false;
+  pthread_mutex_init(&(pool->in_use), NULL);
+  pthread_mutex_init(&(pool->lock), NULL);
+  pthread_cond_init(&(pool->wake), NULL);
+  pthread_cond_init(&(pool->finished), NULL);
+
+  // If some threads can't be started, the pool makes do with fewer.
+  for (size_t i = 0; i < num_threads - 1; i++) {
+    if (pthread_create(pool->threads + i, NULL, __sortpool_thread, pool))
+      break;
+    pool->num_threads++;
+  }
+  return true;
+}
+
+static inline void 
+VPSortPool_destroy(VPSortPool *pool) {
+  pthread_mutex_lock(&(pool->lock));
+  pool->shutdown = true;
+  pthread_cond_broadcast(&(pool->wake));
+  pthread_mutex_unlock(&(pool->lock));
+  for (size_t i = 0; i < pool->num_threads; i++) {
+    if (pthread_join(pool->threads[i], NULL)) {
+      fprintf(stdout, "Error joining pthread.");
+      exit(1);
+    }
+  }
+  pthread_cond_destroy(&(pool->finished));
+  pthread_cond_destroy(&(pool->wake));
+  pthread_mutex_destroy(&(pool->lock));
+  pthread_mutex_destroy(&(pool->in_use));
+  free(pool->threads);
+}
+
+// Calls job_fn on each of the num_jobs jobs, which are job_size bytes apart, 
+// and returns once they're all done. Runs them on the pool if there is one 
+// and it's free, helping out on the calling thread. Otherwise, runs them all
+// on the calling thread.
+static inline void 
+__sortpool_run(VPSortPool *pool, void (*job_fn)(void *job), void *jobs,
+               size_t job_size, size_t num_jobs) {
+  if (!pool || !pool->num_threads || num_jobs < 2 ||
+      pthread_mutex_trylock(&(pool->in_use))) {
+    for (size_t i = 0; i < num_jobs; i++)
+      job_fn((char *)jobs + (job_size * i));
+    return;
+  }
+
+  pthread_mutex_lock(&(pool->lock));
+  pool->job_fn = job_fn;
+  pool->jobs = (char *)jobs;
+  pool->job_size = job_size;
+  pool->num_jobs = num_jobs;
+  pool->next_job = pool->jobs_done = 0;
+  pthread_cond_broadcast(&(pool->wake));
+
+  __sortpool_work(pool);
+  while (pool->jobs_done < pool->num_jobs)
+    pthread_cond_wait(&(pool->finished), &(pool->lock));
+  pool->num_jobs = pool->next_job = pool->jobs_done = 0;
+  pthread_mutex_unlock(&(pool->lock));
+
+  pthread_mutex_unlock(&(pool->in_use));
+}
+
 /**************/
 /* MERGE SORT */
 /**************/
-#define MERGESORT_NUM_THREADS 8
 struct Sublist {
-  VPEntry *arr;
+  VPBuildKey *arr;
   size_t n;
 };
 typedef struct Sublist Sublist;
 
-static void *__mergesort_subsort(void *sublist) {
-  VPEntry *arr = ((Sublist *)sublist)->arr;
-  size_t n = ((Sublist *)sublist)->n;
-  shellsort(arr, n);
-  return NULL;
+// Two sorted runs next to each other in src, to be merged into the same place in dst.
+struct MergeJob {
+  VPBuildKey *src;
+  VPBuildKey *dst;
+  size_t n_first;
+  size_t n_second;
+};
+typedef struct MergeJob MergeJob;
+
+static void __mergesort_subsort(void *sublist) {
+  shellsort(((Sublist *)sublist)->arr, ((Sublist *)sublist)->n);
 }
-static inline void 
-mergesort(VPEntry *arr, size_t n, VPEntry *scratch_space) {
-  const size_t num_threads = MERGESORT_NUM_THREADS;
-  pthread_t threadpool[num_threads - 1];
-  size_t each = n / num_threads;
 
-  size_t mergepos[num_threads];
-  Sublist sublists[num_threads];
-  size_t start = 0;
+static void __mergesort_merge(void *job) {
+  MergeJob *merge = (MergeJob *)job;
+  VPBuildKey *first = merge->src, *first_end = merge->src + merge->n_first;
+  VPBuildKey *second = first_end, *second_end = first_end + merge->n_second;
+  VPBuildKey *dst = merge->dst;
+  while (first < first_end && second < second_end)
+    *dst++ = (second->distance < first->distance) ? *second++ : *first++;
+  while (first < first_end) *dst++ = *first++;
+  while (second < second_end) *dst++ = *second++;
+}
 
-  VPEntry big, smallest;
-  size_t i, j, smallest_idx = 0;
+/*
+ * Splits arr into runs, shellsorts the runs, then merges pairs of them 
+ * together until there's only one left. Both the sorts and the merges 
+ * are run on the pool, if there is one. 
+ */
+static inline void 
+mergesort(VPBuildKey *arr, size_t n, VPBuildKey *scratch_space, VPSortPool *pool,
+          size_t run_size) {
+  // At least one run per thread, and no run much bigger than run_size.
+  size_t num_runs = (n + run_size - 1) / run_size;
+  if (pool && num_runs < pool->num_threads + 1)
+    num_runs = pool->num_threads + 1;
+  size_t each = n / num_runs;
 
-  for (i = 0; i < num_threads; i++) {
-    mergepos[i] = 0;
+  Sublist *runs = (Sublist *)malloc(num_runs * (sizeof(Sublist) + sizeof(MergeJob)));
+  if (!runs) {
+    shellsort(arr, n);
+    return;
   }
+  MergeJob *merges = (MergeJob *)(runs + num_runs);
 
-  // Start threads
-  for (i = 0; i < num_threads - 1; i++) {
-    sublists[i].arr = arr + start;
-    sublists[i].n = each;
-    if (pthread_create(threadpool + i, NULL, __mergesort_subsort,
-                       &sublists[i])) {
-      fprintf(stdout, "Error creating pthread.");
-      exit(1);
-    }
-
-    start = start + each;
+  size_t i, start = 0;
+  for (i = 0; i < num_runs; i++) {
+    runs[i].arr = arr + start;
+    runs[i].n = (i == num_runs - 1) ? n - start : each;
+    start += runs[i].n;
   }
-  sublists[num_threads - 1].arr = arr + start;
-  sublists[num_threads - 1].n = n - start;
-
-  // Sort the last list on the current thread
-  __mergesort_subsort(sublists + (num_threads - 1));
+  __sortpool_run(pool, __mergesort_subsort, runs, sizeof(Sublist), num_runs);
 
-  // Wait for the other threads.
-  for (i = 0; i < num_threads - 1; i++) {
-    if (pthread_join(threadpool[i], NULL)) {
-      fprintf(stdout, "Error joining pthread.");
-      exit(1);
+  // Merge the runs pairwise, going back and forth between arr and the scratch space.
+  VPBuildKey *src = arr, *dst = scratch_space, *temp;
+  while (num_runs > 1) {
+    size_t num_merges = 0;
+    for (i = 0; i + 1 < num_runs; i += 2, num_merges++) {
+      merges[num_merges].src = runs[i].arr;
+      merges[num_merges].dst = dst + (runs[i].arr - src);
+      merges[num_merges].n_first = runs[i].n;
+      merges[num_merges].n_second = runs[i + 1].n;
     }
-  }
+    __sortpool_run(pool, __mergesort_merge, merges, sizeof(MergeJob), num_merges);
 
-  big.distance = (dist_t) INFINITY;
-  (void)(big.item);
+    // The odd run out gets copied over as is.
+    if (num_runs & 1) {
+      Sublist last = runs[num_runs - 1];
+      memcpy(dst + (last.arr - src), last.arr, last.n * sizeof(VPBuildKey));
+    }
 
-  // Merge the arrays
-  for (i = 0; i < n; i++) {
-    smallest = big;
-    for (j = 0; j < num_threads; j++) {
-      if ((mergepos[j] < sublists[j].n) &&
-          (sublists[j].arr[mergepos[j]].distance <= smallest.distance)) {
-        smallest_idx = j;
-        smallest = sublists[j].arr[mergepos[j]];
-      }
+    // The merged runs become the runs for the next pass.
+    for (i = 0; i < num_runs; i += 2) {
+      runs[i / 2].arr = dst + (runs[i].arr - src);
+      runs[i / 2].n = runs[i].n + ((i + 1 < num_runs) ? runs[i + 1].n : 0);
     }
-    mergepos[smallest_idx]++;
-    scratch_space[i] = smallest;
+    num_runs = (num_runs + 1) / 2;
+    temp = src;
+    src = dst;
+    dst = temp;
   }
-  // Copy the list back into the array. Debug = 1 in "vpt.h" to assert that the
-  // array is getting sorted.
-  memcpy(arr, scratch_space, n * sizeof(VPEntry));
+
+  // Copy the list back into the array if it ended up in the scratch space. 
+  // Debug = 1 in "vpt.h" to assert that the array is getting sorted.
+  if (src != arr) memcpy(arr, src, n * sizeof(VPBuildKey));
+  free(runs);
 }
 
 /***************/
 /* MASTER SORT */
 /***************/
-#define SORT_THRESHOLD 2000
+// Lists shorter than threshold are shellsorted on the calling thread.
+// Longer ones are merge sorted, in runs of about threshold entries.
+// Pass SORT_THRESHOLD if you don't have a better value.
 static inline void 
-VPSort(VPEntry *arr, size_t n, VPEntry *scratch_space) {
-  if (n < SORT_THRESHOLD) {
+VPSort(VPBuildKey *arr, size_t n, VPBuildKey *scratch_space, VPSortPool *pool,
+       size_t threshold) {
+  if (!threshold) threshold = 1;
+  if (n < threshold) {
     shellsort(arr, n);
   } else {
-    mergesort(arr, n, scratch_space);
+    mergesort(arr, n, scratch_space, pool, threshold);
   }
   assert_sorted(arr, n);
-}
\ No newline at end of file
+}
+
+/*************/
+/* SELECTION */
+/*************/
+#if DEBUG
+static inline void 
+assert_selected(VPBuildKey *arr, size_t n, size_t k) {
+  for (size_t i = 0; i < n; i++) {
+    assert(i <= k ? arr[i].distance <= arr[k].distance
+                  : arr[i].distance >= arr[k].distance);
+  }
+}
+#else
+static inline void 
+assert_selected(VPBuildKey *arr, size_t n, size_t k) {
+  (void)arr;
+  (void)n;
+  (void)k;
+}
+#endif
+
+static inline void 
+__select_swap(VPBuildKey *arr, size_t i, size_t j) {
+  VPBuildKey temp = arr[i];
+  arr[i] = arr[j];
+  arr[j] = temp;
+}
+
+// Moves the entries with distance equal to value to the back of arr,
+// and returns how many come before them.
+static inline size_t 
+__select_equal_to_back(VPBuildKey *arr, size_t n, dist_t value) {
+  size_t i = 0, j = n;
+  while (i < j) {
+    if (arr[i].distance == value) {
+      __select_swap(arr, i, --j);
+    } else {
+      i++;
+    }
+  }
+  return i;
+}
+
+// Moves the entries with distance equal to value to the front of arr,
+// and returns how many there are.
+static inline size_t 
+__select_equal_to_front(VPBuildKey *arr, size_t n, dist_t value) {
+  size_t num_equal = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (arr[i].distance == value) __select_swap(arr, i, num_equal++);
+  }
+  return num_equal;
+}
+
+// Sifts the entry at i down the max-heap of the first n entries of heap.
+static inline void 
+__select_sift_down(VPBuildKey *heap, size_t n, size_t i) {
+  VPBuildKey entry = heap[i];
+  size_t child;
+  while ((child = 2 * i + 1) < n) {
+    if (child + 1 < n && heap[child + 1].distance > heap[child].distance) child++;
+    if (!(heap[child].distance > entry.distance)) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = entry;
+}
+
+// The same as VPSelect(), in O(n log k) whatever the input. The first k + 1 
+// entries are made a max-heap, and each entry after them that's closer than 
+// the farthest in the heap replaces it. Then the farthest is the kth.
+static inline void 
+__heapselect(VPBuildKey *arr, size_t n, size_t k) {
+  size_t heap_size = k + 1;
+  for (size_t i = heap_size / 2; i--;) __select_sift_down(arr, heap_size, i);
+  for (size_t i = heap_size; i < n; i++) {
+    if (arr[i].distance < arr[0].distance) {
+      __select_swap(arr, 0, i);
+      __select_sift_down(arr, heap_size, 0);
+    }
+  }
+  __select_swap(arr, 0, k);
+}
+
+/*
+ * Rearranges arr so that arr[k] holds the entry that would be there if arr
+ * were sorted, everything before it is no further, and everything after it 
+ * is no closer. Quickselect with a median of three pivot, which falls back 
+ * to heapselect on the part that's left if it keeps picking bad pivots. Runs 
+ * in linear time on average and O(n log n) at worst, and moves far fewer 
+ * entries than VPSort().
+ */
+static inline void 
+VPSelect(VPBuildKey *arr, size_t n, size_t k) {
+  size_t lo = 0, hi = n, depth_limit = 0;
+  for (size_t i = n; i; i >>= 1) depth_limit += 2;
+
+  while (hi - lo > 16) {
+    if (!depth_limit--) break;
+
+    // Order the first, middle, and last entries, then use the middle one as the pivot.
+    size_t mid = lo + (hi - lo) / 2;
+    if (arr[mid].distance < arr[lo].distance) __select_swap(arr, mid, lo);
+    if (arr[hi - 1].distance < arr[lo].distance) __select_swap(arr, hi - 1, lo);
+    if (arr[hi - 1].distance < arr[mid].distance) __select_swap(arr, hi - 1, mid);
+    dist_t pivot = arr[mid].distance;
+
+    // Hoare partition. Afterward, [lo, j] <= pivot <= [j + 1, hi).
+    size_t i = lo - 1, j = hi;
+    for (;;) {
+      do i++; while (arr[i].distance < pivot);
+      do j--; while (arr[j].distance > pivot);
+      if (i >= j) break;
+      __select_swap(arr, i, j);
+    }
+
+    if (k <= j) {
+      hi = j + 1;
+    } else {
+      lo = j + 1;
+    }
+  }
+
+  if (hi - lo > 16) {
+    __heapselect(arr + lo, hi - lo, k - lo);
+  } else {
+    shellsort(arr + lo, hi - lo);
+  }
+  assert_selected(arr, n, k);
+}
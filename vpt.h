@@ -2,8 +2,14 @@
 #define __VPTree
 
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
@@ -25,12 +31,49 @@
 #define DIST_MAX INFINITY
 #endif
 
+// The type used to refer to items by their position while building the tree.
+// Trees can be built out of at most (vpt_idx_t)-1 + 1 items. If you need a 
+// bigger tree than that, #define vpt_idx_t to be uint64_t. VPT_build_stream() 
+// only needs each part of the tree it builds in memory to fit.
+#ifndef vpt_idx_t
+#define vpt_idx_t uint32_t
+#endif
+
 struct VPEntry {
     vpt_t item;
     dist_t distance;
 };
 typedef struct VPEntry VPEntry;
 
+// Called by VPT_within_visit() with each item found, and its distance to the
+// query. Return true to keep searching, or false to stop.
+typedef bool (*VPVisitor)(void* user_data, vpt_t item, dist_t distance);
+
+// Called by VPT_knn_filtered() to ask whether an item may be a result. Return 
+// true to keep it, or false to skip it.
+typedef bool (*VPPredicate)(void* user_data, vpt_t item);
+
+// Called by VPT_self_join() with each pair of items found, and the distance 
+// between them. Return true to keep searching, or false to stop.
+typedef bool (*VPPairVisitor)(void* user_data, vpt_t first, vpt_t second, dist_t distance);
+
+// The k nearest neighbors of every item of a tree, from VPT_knn_graph() or 
+// VPT_knn_join(), as a matrix in compressed sparse row form. Every row has k 
+// entries, so row i starts at i * k, and holds the neighbors of items[i], 
+// nearest first, as indices into neighbor_items and their distances. For 
+// VPT_knn_graph(), neighbor_items is items. k is fewer than asked for if 
+// there aren't enough items to go around.
+struct VPKnnGraph {
+    size_t num_items;
+    size_t k;
+    vpt_t* items;
+    size_t num_neighbor_items;
+    vpt_t* neighbor_items;
+    vpt_idx_t* indices;
+    dist_t* distances;
+};
+typedef struct VPKnnGraph VPKnnGraph;
+
 /********************/
 /* External Structs */
 /********************/
@@ -42,15 +85,150 @@ typedef struct VPEntry VPEntry;
 struct VPTree;
 typedef struct VPTree VPTree;
 
+// Walks the items of a tree nearest first. See VPT_neighbors_init().
+struct VPTNeighborIterator;
+typedef struct VPTNeighborIterator VPTNeighborIterator;
+
+// How the vantage point of each node is picked from the items under it.
+enum VPVantageStrategy {
+    // The first item, in the order the data was given. Free, but the quality
+    // of the tree depends on the order of the input.
+    VPT_VP_FIRST,
+    // An item picked at random.
+    VPT_VP_RANDOM,
+    // Of a random sample of items, the one whose distances to another random 
+    // sample are the most spread out around their median (Yianilos, 1993).
+    // Costs vp_sample_size^2 distance calculations per node.
+    VPT_VP_SAMPLE_SPREAD,
+    // The item farthest from the parent's vantage point. These distances are 
+    // already known, so it costs nothing, except at the root.
+    VPT_VP_FARTHEST_FROM_PARENT
+};
+typedef enum VPVantageStrategy VPVantageStrategy;
+
+// Options for how a tree is built. Get the defaults from VPT_default_config(),
+// change what you need, and pass it to VPT_build_config(). The tree keeps a
+// copy, so VPT_rebuild() and VPT_add_rebuild() build the same way.
+struct VPTConfig {
+    // The number of threads to build the tree with. 1 builds on the calling
+    // thread only. 0 uses one thread per online core.
+    size_t build_threads;
+
+    // Whether to split each node by finding the median distance with 
+    // VPSelect() in linear time, rather than sorting all of the node's 
+    // entries with VPSort().
+    bool median_selection;
+
+    // The number of threads VPSort() uses to sort each node's entries when 
+    // median_selection is off. They're started once, and shared by every 
+    // sort in the build. 0 uses one thread per online core.
+    size_t sort_threads;
+
+    // When median_selection is off, lists shorter than this are shellsorted,
+    // and longer ones are merge sorted in runs about this long.
+    size_t sort_threshold;
+
+    // Nodes with fewer items than this become leaves, which are searched 
+    // item by item. Must be at least 3.
+    size_t leaf_size;
+
+    // Trees with fewer items than this are built as a single leaf.
+    size_t small_tree_size;
+
+    // How each node's vantage point is picked. Better vantage points cost 
+    // more to find, but make for fewer distance calculations per query. 
+    // Use VPT_knn_cost() to compare.
+    VPVantageStrategy vp_strategy;
+
+    // For VPT_VP_SAMPLE_SPREAD, the number of candidates to sample, and 
+    // the number of items to compare each candidate to.
+    size_t vp_sample_size;
+
+    // Seeds the random choices of VPT_VP_RANDOM and VPT_VP_SAMPLE_SPREAD. 
+    // The same data, config, and seed always build the same tree, no matter
+    // how many threads build it.
+    uint64_t vp_seed;
+
+    // Keep each leaf item's distance to the vantage point of the leaf's 
+    // parent, which the build calculates anyway. Queries use them to skip 
+    // calling dist_fn on leaf items that can't be close enough. Costs a 
+    // dist_t per item, and is worth it when dist_fn is expensive.
+    bool leaf_distances;
+
+    // Have VPT_knn() and VPT_nn() search the subtree that could be closest 
+    // to the query first, instead of going depth first. The search stops as 
+    // soon as nothing left could make it into the results, so tau shrinks 
+    // sooner and more subtrees are pruned, but the queue takes upkeep. Read 
+    // by each query, so it can be changed without rebuilding.
+    bool best_first;
+
+    // Build multi-vantage-point nodes, which split their items by their 
+    // distance to one vantage point into mvp_fanout parts, and each of those 
+    // by their distance to a second vantage point into mvp_fanout more, for 
+    // mvp_fanout * mvp_fanout children. Queries rule out children using both 
+    // distances at once, so they take fewer distance calculations, which is 
+    // worth it when dist_fn is expensive. 0 builds binary nodes instead. At 
+    // most VPT_MAX_MVP_FANOUT. Nodes too small to split that many ways, and 
+    // the parts of the tree VPT_build_stream() spills, are binary either way.
+    size_t mvp_fanout;
+};
+typedef struct VPTConfig VPTConfig;
+
+#ifdef VPT_STATS
+// What a query did, for working out why it was fast or slow. Only kept when 
+// VPT_STATS is #defined before including this file. Otherwise, queries 
+// don't count anything, and cost nothing extra. See VPT_last_query_stats() 
+// and VPT_stats().
+struct VPTQueryStats {
+    // Calls to the tree's distance function
+    size_t dist_calls;
+    // Branch nodes whose vantage point was compared to the query
+    size_t branches_visited;
+    // Leaves whose items were searched
+    size_t leaves_scanned;
+    // Subtrees skipped without being visited, because nothing in them could 
+    // be close enough, or because the search ended before they were reached
+    size_t subtrees_pruned;
+    // The most subtrees that were waiting to be searched at once
+    size_t max_stack_depth;
+};
+typedef struct VPTQueryStats VPTQueryStats;
+#endif
+
 /**********************/
 /* Tunable Parameters */
 /**********************/
 
+// VPT_BUILD_LIST_THRESHOLD and VPT_MAX_LIST_SIZE are only the defaults for 
+// VPTConfig's leaf_size and small_tree_size, just like SORT_THRESHOLD in 
+// vpsort.h is for sort_threshold. Change them per build in the config.
+// VPT_MAX_HEIGHT is not a limit on the height of the tree. It's how many 
+// entries the build and query stacks start out with on the C stack. Trees 
+// taller than that use stacks on the heap instead.
 #define VPT_BUILD_LIST_THRESHOLD 100
 #define VPT_MAX_HEIGHT 100
 #define VPT_MAX_LIST_SIZE 1000
 #define NODEALLOC_BUF_SIZE 1000
 #define LISTALLOC_BUF_SIZE 1000000
+#define VPT_PARALLEL_BUILD_GRAIN 10000
+#define VPT_MAX_VP_SAMPLE_SIZE 64
+#define VPT_AUTOTUNE_SAMPLE_SIZE 20000
+#define VPT_AUTOTUNE_NUM_QUERIES 200
+#define VPT_AUTOTUNE_K 10
+#define VPT_STREAM_READ_SIZE 4096
+#define VPT_BATCH_GRAIN 64
+#define VPT_BEST_FIRST_QUEUE_SIZE 256
+#define VPT_KNN_HEAP_THRESHOLD 32
+#define VPT_MAX_MVP_FANOUT 8
+#define VPT_JOIN_TASKS_PER_THREAD 16
+#define VPT_JOIN_GROUP_SPREAD 1.0
+#define VPT_KNN_GRAPH_MAX_LEAF 1024
+
+// The most children a node can have.
+#define __VPT_MAX_CHILDREN (VPT_MAX_MVP_FANOUT * VPT_MAX_MVP_FANOUT)
+
+// No entry of a VPCache.
+#define __VPT_CACHE_NONE ((size_t)-1)
 
 /**********************/
 /* Struct Definitions */
@@ -62,28 +240,127 @@ union VPNodeUnion;
 typedef union VPNodeUnion VPNodeUnion;
 struct VPBranch;
 typedef struct VPBranch VPBranch;
+struct VPMulti;
+typedef struct VPMulti VPMulti;
+struct VPMultiChild;
+typedef struct VPMultiChild VPMultiChild;
 struct PList;
 typedef struct PList PList;
 
-/* This is a labeled union, containing either a branch 
-   in the tree, or a point list. */
-struct VPNode {  /* 40 with vpt_t = void*. */
+/* This is a labeled union, containing either a branch ('b') 
+   or a multi-vantage-point branch ('m') in the tree, or a 
+   point list ('l'). */
+struct VPNode {  /* 64 with vpt_t = void*. */
     char ulabel;
     union VPNodeUnion {
         struct VPBranch {
             vpt_t item;
+            /* The distances from item to everything in the left subtree are 
+               in [left_min, radius], and to everything in the right subtree 
+               are in [right_min, right_max]. radius < right_min. If the right 
+               subtree is empty, right_min is DIST_MAX and right_max is 0. */
             dist_t radius;
+            dist_t left_min;
+            dist_t right_min;
+            dist_t right_max;
             VPNode* left;
             VPNode* right;
         } branch;
+        /* Child i * fanout + j holds part j of part i of the items split 
+           by their distance to items[0], split by their distance to items[1]. */
+        struct VPMulti {
+            vpt_t items[2];
+            VPMultiChild* children;
+            size_t fanout;
+        } multi;
         struct PList {
             vpt_t* items;
+            dist_t* distances; /* To the parent's vantage point, or NULL. */
             size_t size;
             size_t capacity;
         } pointlist;
     } u;
 };
 
+/* A child of a multi-vantage-point branch. The distances from its items to 
+   the branch's items[v] are in [min[v], max[v]]. An empty child has a min 
+   of DIST_MAX and a max of 0. */
+struct VPMultiChild {
+    VPNode* node;
+    dist_t min[2];
+    dist_t max[2];
+};
+
+/* A node on a query's traversal stack, and the distance from 
+   the query to the vantage point of the node's parent. */
+struct NodeDistTuple {
+    VPNode* node;
+    dist_t dist;
+};
+typedef struct NodeDistTuple NodeDistTuple;
+
+/* A node of a tree, and the position of its first item in the depth-first 
+   order VPT_knn_graph() lists the tree's items in. */
+struct VPNodeRow {
+    VPNode* node;
+    size_t first;
+};
+typedef struct VPNodeRow VPNodeRow;
+
+/* The nodes of a tree, sorted by address, to look up the positions of the 
+   items a search finds in them. */
+struct VPNodeRows {
+    VPNodeRow* nodes;
+    size_t num_nodes;
+};
+typedef struct VPNodeRows VPNodeRows;
+
+/* The k nearest items a knn search has found so far, and the distance an item 
+   has to beat to join them. For small k, they're kept in a sorted array, which 
+   is cheap to insert into when k is small. For k of VPT_KNN_HEAP_THRESHOLD and 
+   up, they're kept in a max-heap, written straight into the caller's result 
+   space and sorted at the end. VPT_knn_graph() also keeps the positions of 
+   the items in indices, in the same order as the entries, if it's set. */
+struct VPKnnList {
+    VPEntry* entries;
+    size_t size;
+    size_t k;
+    dist_t tau;
+    vpt_idx_t* indices;
+    const VPNodeRows* rows;
+};
+typedef struct VPKnnList VPKnnList;
+
+/* A subtree waiting to be searched by a best-first query, 
+   and how close the query could be to anything in it. */
+struct VPQueueEntry {
+    dist_t bound;
+    NodeDistTuple subtree;
+};
+typedef struct VPQueueEntry VPQueueEntry;
+
+/* A binary min-heap of VPQueueEntries, by bound. It starts out in a buffer 
+   on the C stack, and moves to the heap if it outgrows it. */
+struct VPQueue {
+    VPQueueEntry* entries;
+    VPQueueEntry* buffer;
+    size_t size;
+    size_t capacity;
+};
+typedef struct VPQueue VPQueue;
+
+/* Between calls to VPT_neighbors_next(), the subtrees it hasn't searched yet, 
+   and the items it has found but not returned yet. Both are kept in heaps, 
+   which, unlike a VPQueue used by a single query, start out on the heap. */
+struct VPTNeighborIterator {
+    VPTree* vpt;
+    vpt_t query;
+    VPQueue subtrees;
+    VPEntry* items; /* A binary min-heap, by distance. */
+    size_t num_items;
+    size_t items_capacity;
+};
+
 /* Linked list for node allocations, built from the front */
 struct NodeAllocs;
 typedef struct NodeAllocs NodeAllocs;
@@ -101,27 +378,282 @@ struct ListAllocs {
     ListAllocs* next;
 };
 
+/* Only allocated from for trees built with leaf_distances. */
+struct DistAllocs;
+typedef struct DistAllocs DistAllocs;
+struct DistAllocs {
+    dist_t buffer[LISTALLOC_BUF_SIZE];
+    size_t size;
+    DistAllocs* next;
+};
+
+/* Only allocated from for trees with multi-vantage-point branches. */
+struct ChildAllocs;
+typedef struct ChildAllocs ChildAllocs;
+struct ChildAllocs {
+    VPMultiChild buffer[NODEALLOC_BUF_SIZE];
+    size_t size;
+    ChildAllocs* next;
+};
+
 struct VPAllocator {
     NodeAllocs* node_allocs;
     ListAllocs* list_allocs;
+    DistAllocs* dist_allocs;
+    ChildAllocs* child_allocs;
 };
 typedef struct VPAllocator VPAllocator;
 
+#ifdef VPT_STATS
+/* The sums of the VPTQueryStats of every query since the tree was built, 
+   except for max_stack_depth, which is the largest. Queries from different 
+   threads add to them at once. */
+struct VPTreeStats {
+    atomic_size_t num_queries;
+    atomic_size_t dist_calls;
+    atomic_size_t branches_visited;
+    atomic_size_t leaves_scanned;
+    atomic_size_t subtrees_pruned;
+    atomic_size_t max_stack_depth;
+};
+typedef struct VPTreeStats VPTreeStats;
+#endif
+
+/* The results of a query in a VPCache. k is 0 for VPT_all_within() queries, 
+   and max_dist is 0 for knn queries. results has room for capacity entries, 
+   and is kept when the entry is reused. The entry is in the hash chain of 
+   its bucket, and in the list of entries from newest to oldest. */
+struct VPCacheEntry {
+    vpt_t query;
+    uint64_t hash;
+    size_t k;
+    dist_t max_dist;
+    VPEntry* results;
+    size_t num_results;
+    size_t capacity;
+    size_t chain;
+    size_t newer;
+    size_t older;
+};
+typedef struct VPCacheEntry VPCacheEntry;
+
+/* The least recently used results of queries on a tree. See VPT_cache_init(). 
+   Entries are indices into entries, or __VPT_CACHE_NONE. There are capacity 
+   buckets, and the first num_entries entries are in use. */
+struct VPCache {
+    pthread_mutex_t lock;
+    uint64_t (*hash_fn)(void* extra_data, vpt_t item);
+    VPCacheEntry* entries;
+    size_t* buckets;
+    size_t capacity;
+    size_t num_entries;
+    size_t newest;
+    size_t oldest;
+    size_t hits;
+    size_t misses;
+};
+typedef struct VPCache VPCache;
+
 struct VPTree {
     VPNode* root;
     size_t size;
+    size_t height; /* Nodes on the longest path from the root to a leaf. */
     VPAllocator allocator;
     void* extra_data;
     dist_t (*dist_fn)(void* extra_data, vpt_t first, vpt_t second);
+    VPTConfig config;
+    VPCache* cache; /* NULL unless VPT_cache_init() was called. */
+#ifdef VPT_STATS
+    VPTreeStats stats;
+#endif
+};
+
+/* What the tree build sorts instead of the items themselves, which may be 
+   large. The item is data[index] in the data the tree is being built from. */
+struct VPBuildKey {
+    dist_t distance;
+    vpt_idx_t index;
 };
+typedef struct VPBuildKey VPBuildKey;
 
+/* A node that still needs to be built. When it is, it gets linked into the 
+   tree by writing it to dest, which points into its parent (or at the root). */
 struct VPBuildStackFrame {
-    VPNode* parent;
-    VPEntry* children;
+    VPNode** dest;
+    VPBuildKey* children;
     size_t num_children;
+    size_t depth; /* The root is at depth 1. */
 };
 typedef struct VPBuildStackFrame VPBuildStackFrame;
 
+/* A part of the items that VPT_build_stream() has spilled to a temporary file, 
+   as VPEntries whose distances are to the vantage point of the parent node. */
+struct VPSpillFrame {
+    FILE* file;
+    size_t num_items;
+    VPNode** dest;
+    size_t depth;
+};
+typedef struct VPSpillFrame VPSpillFrame;
+
+/* Frames waiting to be built by one thread of a parallel build. The owning 
+   thread pushes and pops at the back, other threads steal from the front. */
+struct VPBuildDeque {
+    pthread_mutex_t lock;
+    VPBuildStackFrame* frames;
+    size_t front;
+    size_t back;
+    size_t capacity;
+};
+typedef struct VPBuildDeque VPBuildDeque;
+
+struct VPBuildWorker;
+typedef struct VPBuildWorker VPBuildWorker;
+struct VPBuild;
+typedef struct VPBuild VPBuild;
+struct VPSortPool;
+typedef struct VPSortPool VPSortPool;
+
+struct VPBuildWorker {
+    VPBuild* build;
+    size_t id;
+    pthread_t thread;
+    VPAllocator allocator; /* Each thread allocates nodes and lists from its own arena. */
+    VPBuildDeque deque;
+    size_t height; /* Of the part of the tree this thread built. */
+};
+
+/* Everything shared by the threads building a tree. */
+struct VPBuild {
+    VPTree* vpt;
+    vpt_t* data;
+    VPBuildKey* build_buffer;
+    VPBuildKey* scratch_space;
+    VPSortPool* sort_pool;
+
+    /* Only used by parallel builds */
+    VPBuildWorker* workers;
+    size_t num_workers;
+    atomic_size_t pending; /* Frames pushed but not yet finished. */
+    atomic_bool failed;
+    pthread_mutex_t idle_lock; /* Idle workers wait on wake for something to change. */
+    pthread_cond_t wake;
+    atomic_size_t num_wakes;   /* Changed under idle_lock, each time wake is signaled. */
+};
+
+/* Everything shared by the threads answering a batch of queries. Each thread 
+   claims VPT_BATCH_GRAIN queries at a time, starting from next_query. */
+struct VPQueryBatch {
+    VPTree* vpt;
+    vpt_t* queries;
+    size_t num_queries;
+    size_t k;                 /* For VPT_knn_batch() */
+    VPEntry* knn_results;     /* For VPT_knn_batch() */
+    dist_t max_dist;          /* For VPT_all_within_batch() */
+    VPEntry** within_results; /* For VPT_all_within_batch() */
+    size_t* num_results;
+    atomic_size_t next_query;
+    atomic_bool failed;
+};
+typedef struct VPQueryBatch VPQueryBatch;
+
+/* One side of a part of a VPT_self_join(): a subtree, and the shell around a 
+   vantage point of its parent that everything in it is in. The vantage point 
+   is item center_index of the branch center, or there's none if center is NULL. */
+struct VPJoinSide {
+    VPNode* node;
+    VPNode* center;
+    size_t center_index;
+    dist_t min;
+    dist_t max;
+};
+typedef struct VPJoinSide VPJoinSide;
+
+/* A part of a VPT_self_join() still to be done. It finds the pairs within 
+   sides[0] if self_join is set, and the pairs between sides[0] and sides[1] 
+   otherwise. */
+struct VPJoinTask {
+    VPJoinSide sides[2];
+    bool self_join;
+};
+typedef struct VPJoinTask VPJoinTask;
+
+/* A growable list of VPJoinTasks. */
+struct VPJoinTasks {
+    VPJoinTask* tasks;
+    size_t size;
+    size_t capacity;
+};
+typedef struct VPJoinTasks VPJoinTasks;
+
+/* Everything shared by the threads of a VPT_self_join(). Each thread claims 
+   one task at a time, starting from next_task, and finishes it on its own. */
+struct VPSelfJoin {
+    VPTree* vpt;
+    dist_t eps;
+    VPPairVisitor visitor;
+    void* user_data;
+    VPJoinTask* tasks;
+    size_t num_tasks;
+    atomic_size_t next_task;
+    atomic_bool failed;
+    atomic_bool stopped;
+};
+typedef struct VPSelfJoin VPSelfJoin;
+
+/* A vantage point being searched for in a subtree by VPT_self_join(). */
+struct VPJoinPoint {
+    VPSelfJoin* join;
+    vpt_t point;
+};
+typedef struct VPJoinPoint VPJoinPoint;
+
+/* Everything shared by the threads of a VPT_knn_graph(), VPT_knn_join(), or 
+   VPT_join_within(). The items of each node of vpt are listed together, in the 
+   order of nodes, starting from the node's first row of the graph. Each thread 
+   claims one node at a time, starting from next_node, and finds the neighbors 
+   of its items in the reference tree, which is vpt itself for VPT_knn_graph(). 
+   reference_rows looks up where the neighbors are in graph->neighbor_items. 
+   VPT_join_within() has no graph, and hands the pairs it finds to the visitor. */
+struct VPKnnGraphBuild {
+    VPTree* vpt;
+    VPTree* reference;
+    VPKnnGraph* graph;
+    VPNodeRow* nodes;
+    size_t num_nodes;
+    VPNodeRows reference_rows;
+    dist_t eps;
+    VPPairVisitor visitor;
+    void* user_data;
+    atomic_size_t next_node;
+    atomic_bool failed;
+    atomic_bool stopped;
+};
+typedef struct VPKnnGraphBuild VPKnnGraphBuild;
+
+/* Queries close to each other, like the items of a leaf, that are searched 
+   for together in one walk of the reference tree, led by queries[0]. Each 
+   query's distance to the leader is its spread. Queries too far from the 
+   leader to be worth the company are dropped from the active ones, and 
+   searched for on their own afterwards. VPT_knn_join() keeps a list of 
+   neighbors for each query, VPT_join_within() keeps none. The space is 
+   reused for each group, by one thread, and grows to fit the biggest. Each 
+   query's list has k + 1 of the buffers and indices, and is finished in place. */
+struct VPQueryGroup {
+    vpt_t* queries;
+    size_t num_queries;
+    VPKnnList* lists;
+    VPEntry* buffers;
+    vpt_idx_t* indices;
+    dist_t* spread;
+    size_t* active;
+    size_t num_active;
+    size_t capacity;
+    NodeDistTuple* to_traverse;
+    size_t dist_calls;
+};
+typedef struct VPQueryGroup VPQueryGroup;
+
 /***********************************/
 /* Sort (Necessary for tree build) */
 /***********************************/
@@ -195,6 +727,99 @@ __alloc_VPList(VPAllocator* allocator, size_t buf_size) {
     return allocated_list;
 }
 
+static inline dist_t*
+__alloc_VPDistList(VPAllocator* allocator, size_t buf_size) {
+    // Same as __alloc_VPList(), but the first buffer isn't allocated until it's needed.
+    DistAllocs* dist_allocs = allocator->dist_allocs;
+    if (!dist_allocs || dist_allocs->size + buf_size >= LISTALLOC_BUF_SIZE - 1) {
+        DistAllocs* new_list = (DistAllocs*) malloc(sizeof(DistAllocs));
+        if (!new_list) return NULL;
+        new_list->size = 0;
+        new_list->next = allocator->dist_allocs;
+        allocator->dist_allocs = new_list;
+        dist_allocs = new_list;
+    }
+
+    dist_t* allocated_list = dist_allocs->buffer + dist_allocs->size;
+    dist_allocs->size += buf_size;
+
+    debug_printf("Allocated a distance list buffer of size %zu.\n", buf_size);
+    return allocated_list;
+}
+
+static inline VPMultiChild*
+__alloc_VPMultiChildren(VPAllocator* allocator, size_t num_children) {
+    // Same as __alloc_VPDistList(). There are never more than __VPT_MAX_CHILDREN.
+    ChildAllocs* child_allocs = allocator->child_allocs;
+    if (!child_allocs || child_allocs->size + num_children > NODEALLOC_BUF_SIZE) {
+        ChildAllocs* new_list = (ChildAllocs*) malloc(sizeof(ChildAllocs));
+        if (!new_list) return NULL;
+        new_list->size = 0;
+        new_list->next = allocator->child_allocs;
+        allocator->child_allocs = new_list;
+        child_allocs = new_list;
+    }
+
+    VPMultiChild* children = child_allocs->buffer + child_allocs->size;
+    child_allocs->size += num_children;
+
+    debug_printf("Allocated %zu children.\n", num_children);
+    return children;
+}
+
+// On failure, every list is left empty, so the tree can still be destroyed.
+static inline bool
+__VPT_init_allocator(VPAllocator* allocator) {
+    allocator->node_allocs = (NodeAllocs*) malloc(sizeof(NodeAllocs));
+    allocator->list_allocs = (ListAllocs*) malloc(sizeof(ListAllocs));
+    if (!allocator->node_allocs || !allocator->list_allocs) {
+        free(allocator->node_allocs);
+        free(allocator->list_allocs);
+        allocator->node_allocs = NULL;
+        allocator->list_allocs = NULL;
+        allocator->dist_allocs = NULL;
+        allocator->child_allocs = NULL;
+        return false;
+    }
+    allocator->node_allocs->size = 0;
+    allocator->node_allocs->next = NULL;
+    allocator->list_allocs->size = 0;
+    allocator->list_allocs->next = NULL;
+    allocator->dist_allocs = NULL;
+    allocator->child_allocs = NULL;
+    return true;
+}
+
+// Moves all the buffers owned by from onto the end of into's lists. 
+// The nodes and lists stay where they are, so pointers to them stay valid.
+static inline void
+__VPT_splice_allocator(VPAllocator* into, VPAllocator* from) {
+    if (from->node_allocs) {
+        NodeAllocs** node_tail = &(into->node_allocs);
+        while (*node_tail) node_tail = &((*node_tail)->next);
+        *node_tail = from->node_allocs;
+    }
+    if (from->list_allocs) {
+        ListAllocs** list_tail = &(into->list_allocs);
+        while (*list_tail) list_tail = &((*list_tail)->next);
+        *list_tail = from->list_allocs;
+    }
+    if (from->dist_allocs) {
+        DistAllocs** dist_tail = &(into->dist_allocs);
+        while (*dist_tail) dist_tail = &((*dist_tail)->next);
+        *dist_tail = from->dist_allocs;
+    }
+    if (from->child_allocs) {
+        ChildAllocs** child_tail = &(into->child_allocs);
+        while (*child_tail) child_tail = &((*child_tail)->next);
+        *child_tail = from->child_allocs;
+    }
+    from->node_allocs = NULL;
+    from->list_allocs = NULL;
+    from->dist_allocs = NULL;
+    from->child_allocs = NULL;
+}
+
 /**********************/
 /* Internal Functions */
 /**********************/
@@ -204,8 +829,10 @@ __VPT_small_build(VPTree* vpt, vpt_t* data, size_t num_items) {
     vpt->root = __alloc_VPNode(&(vpt->allocator));
     if (!vpt->root) return false;
     vpt->root->ulabel = 'l';
+    vpt->root->u.pointlist.distances = NULL;
+    vpt->height = 1;
     vpt->root->u.pointlist.size = num_items;
-    vpt->root->u.pointlist.capacity = VPT_MAX_LIST_SIZE;
+    vpt->root->u.pointlist.capacity = max(vpt->config.small_tree_size, num_items);
     vpt->root->u.pointlist.items = __alloc_VPList(&(vpt->allocator), vpt->root->u.pointlist.capacity);
     if (!vpt->root->u.pointlist.items) return false;
     for (size_t i = 0; i < num_items; i++) {
@@ -214,15 +841,30 @@ __VPT_small_build(VPTree* vpt, vpt_t* data, size_t num_items) {
     return true;
 }
 
-// Sorts a single element into position from just outside the list.
+#if DEBUG
+static inline void 
+assert_knnlist_sorted(VPEntry* knnlist, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        assert(knnlist[i - 1].distance <= knnlist[i].distance);
+    }
+}
+#else
+static inline void 
+assert_knnlist_sorted(VPEntry* knnlist, size_t n) {
+    (void)knnlist;
+    (void)n;
+}
+#endif
+
+// Sorts a single element into position from just outside the list, and returns the position.
 // Not suitable for knn. Operates on a list that has already been constructed sorted.
-static inline void
+static inline size_t
 __knnlist_push(VPEntry* knnlist, size_t knnlist_size, vpt_t to_add_item, dist_t to_add_dist) {
     // Put the item right outside the list. We have allocated beyond the list, so this is okay.
     knnlist[knnlist_size].item = to_add_item;
     knnlist[knnlist_size].distance = to_add_dist;
 
-    if (!knnlist_size) return;
+    if (!knnlist_size) return 0;
     size_t n = knnlist_size;
 
     // Shift the item inwards
@@ -233,342 +875,1558 @@ __knnlist_push(VPEntry* knnlist, size_t knnlist_size, vpt_t to_add_item, dist_t
             knnlist[n] = knnlist[n - 1];
             knnlist[n - 1] = temp;
         } else
-            return;
+            return n;
 
         n--;
     } while (n);
 
-    assert_sorted(knnlist, knnlist_size);
+    assert_knnlist_sorted(knnlist, knnlist_size);
+    return 0;
 }
 
-/****************/
-/* Tree Methods */
-/****************/
+// The space a knn search needs besides the result space, in VPEntries.
+#define __VPT_KNNLIST_BUFFER_SIZE(k) ((k) < VPT_KNN_HEAP_THRESHOLD ? (k) + 1 : 1)
 
-/**
- * Constructs a Vantage Point Tree out of the given data.
- * Destroy this tree using VPT_destroy or VPT_teardown.
- * 
- * This tree can store data of any type vpt_t for which the 
- * set of possible items forms a metric space with distance 
- * function dist_fn. You should #define vpt_t to be the type 
- * that the tree should store before you #include "vpt.h".
- * If you don't, the default is void*.
- *
- * Do not build a VPTree of size zero. The tree does not take 
- * ownership of the data, it stores copies.
- * 
- * @param vpt The Vantage Point Tree to build.
- * @param data A pointer to the data to construct the tree out of. 
- * @param num_items The size of the data array.                
- * @param dist_fn A metric on the metric space of values of vpt_t.
- * @param extra_data Additional information to be passed to the dist_fn callback.
- * @return true if building the tree was successful, false if out of memory.
- *             No guaruntees on the state of the tree on failure.
- */
-static inline bool
-VPT_build(VPTree* vpt, vpt_t* data, size_t num_items,
-          dist_t (*dist_fn)(void* extra_data, vpt_t first, vpt_t second), void* extra_data) {
-    vpt->size = num_items;
-    vpt->dist_fn = dist_fn;
-    vpt->extra_data = extra_data;
+static inline void
+__VPT_knnlist_init(VPKnnList* list, size_t k, VPEntry* buffer, VPEntry* result_space) {
+    list->entries = k < VPT_KNN_HEAP_THRESHOLD ? buffer : result_space;
+    list->size = 0;
+    list->k = k;
+    list->tau = (dist_t) DIST_MAX;
+    list->indices = NULL;
+    list->rows = NULL;
+}
 
-    /* Init allocator */
-    vpt->allocator.node_allocs = (NodeAllocs*) malloc(sizeof(NodeAllocs));
-    if (!vpt->allocator.node_allocs) return false;
-    vpt->allocator.node_allocs->size = 0;
-    vpt->allocator.node_allocs->next = NULL;
+// Moves entries down the max-heap from the hole at i until there's a place 
+// for an entry at dist, and returns that place. Moves indices along with 
+// them, unless it's NULL.
+static inline size_t
+__VPT_knnheap_sift_down(VPEntry* heap, vpt_idx_t* indices, size_t size, size_t i, dist_t dist) {
+    size_t child;
+    while ((child = 2 * i + 1) < size) {
+        if (child + 1 < size && heap[child + 1].distance > heap[child].distance) child++;
+        if (!(heap[child].distance > dist)) break;
+        heap[i] = heap[child];
+        if (indices) indices[i] = indices[child];
+        i = child;
+    }
+    return i;
+}
 
-    vpt->allocator.list_allocs = (ListAllocs*) malloc(sizeof(ListAllocs));
-    if (!vpt->allocator.list_allocs) return false;
-    vpt->allocator.list_allocs->size = 0;
-    vpt->allocator.list_allocs->next = NULL;
+// Adds an item closer than tau to the list, at the given position if the 
+// list keeps positions, and returns the new tau.
+static inline dist_t
+__VPT_knnlist_add_index(VPKnnList* list, vpt_t item, dist_t dist, size_t index) {
+    VPEntry* entries = list->entries;
+    vpt_idx_t* indices = list->indices;
+    size_t i;
+    if (list->k < VPT_KNN_HEAP_THRESHOLD) {
+        i = __knnlist_push(entries, list->size, item, dist);  // Minimal to no actual sorting
+        if (indices) {
+            for (size_t j = list->size; j > i; j--) indices[j] = indices[j - 1];
+            indices[i] = (vpt_idx_t)index;
+        }
+        list->size = min(list->size + 1, list->k);         // No branch on both x86 and ARM
+        if (list->size == list->k) list->tau = entries[list->k - 1].distance;
+        return list->tau;
+    }
 
-    if (num_items < VPT_MAX_LIST_SIZE) {
-        LOG("Building small tree of size %lu.\n", num_items)
-        return __VPT_small_build(vpt, data, num_items);
+    // Sift the item up from the end while there's room, then replace the farthest.
+    if (list->size < list->k) {
+        i = list->size++;
+        while (i && entries[(i - 1) / 2].distance < dist) {
+            entries[i] = entries[(i - 1) / 2];
+            if (indices) indices[i] = indices[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else {
+        i = __VPT_knnheap_sift_down(entries, indices, list->size, 0, dist);
     }
-    LOG("Building large tree of size %lu.\n", num_items)
+    entries[i].item = item;
+    entries[i].distance = dist;
+    if (indices) indices[i] = (vpt_idx_t)index;
+    if (list->size == list->k) list->tau = entries[0].distance;
+    return list->tau;
+}
 
-    size_t i;
+// Adds an item closer than tau to the list, and returns the new tau.
+static inline dist_t
+__VPT_knnlist_add(VPKnnList* list, vpt_t item, dist_t dist) {
+    return __VPT_knnlist_add_index(list, item, dist, 0);
+}
+
+// The position of the item at offset among the items of a node, in the order 
+// rows was listed in. The node must be in rows.
+static inline size_t
+__VPT_node_row(const VPNodeRows* rows, VPNode* node, size_t offset) {
+    size_t lo = 0, hi = rows->num_nodes;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)rows->nodes[mid].node <= (uintptr_t)node) lo = mid;
+        else hi = mid;
+    }
+#if DEBUG
+    assert(rows->nodes[lo].node == node);
+#endif
+    return rows->nodes[lo].first + offset;
+}
 
-    /* Node to partition into left and right lists */
-    VPNode* newnode;
-    VPEntry *right_children, *left_children;
-    size_t right_num_children, left_num_children;
+// Adds an item a search found at offset among the items of node, the same as 
+// __VPT_knnlist_add(), looking up its position if the list keeps positions.
+static inline dist_t
+__VPT_knnlist_add_found(VPKnnList* list, vpt_t item, dist_t dist, VPNode* node, size_t offset) {
+    size_t index = list->indices ? __VPT_node_row(list->rows, node, offset) : 0;
+    return __VPT_knnlist_add_index(list, item, dist, index);
+}
 
-    /* Hold information about the nodes that still need to be created, both on the left and right */
-    VPBuildStackFrame popped;
-    VPBuildStackFrame leftstack[VPT_MAX_HEIGHT];
-    VPBuildStackFrame rightstack[VPT_MAX_HEIGHT];
-    size_t left_stacksize = 0, right_stacksize = 0;
-
-    /* Pop the first item off the list of points. It will become the root. */
-    vpt_t sort_by = *data;
-    data += 1;
-    size_t num_entries = (num_items - 1);
-    LOGs("Popped first item off list.");
-
-    /* Copy the rest of the data into an array so it can be sorted and resorted as the tree is built */
-    VPEntry* build_buffer;
-    VPEntry* entry_list = build_buffer = (VPEntry*) malloc(num_entries * sizeof(VPEntry));
-    if (!entry_list) return false;
-    for (i = 0; i < num_entries; i++) {
-        entry_list[i].item = data[i];
+// Writes the list to the result space, sorted nearest first. If the list keeps 
+// positions, they're sorted the same way, in place.
+static inline void
+__VPT_knnlist_finish(VPKnnList* list, VPEntry* result_space, size_t* num_results) {
+    VPEntry* entries = list->entries;
+    vpt_idx_t* indices = list->indices;
+    *num_results = list->size;
+    if (list->k < VPT_KNN_HEAP_THRESHOLD) {
+        for (size_t i = 0; i < list->size; i++)
+            result_space[i] = entries[i];
+        return;
     }
-    LOGs("Entry list copied.");
 
-    /* Allocate some space to help with sorting. */
-    VPEntry* scratch_space = (VPEntry*) malloc(num_entries * sizeof(VPEntry));
-    if (!scratch_space) return false;
-    LOGs("Allocated scratch space.");
+    // Heapsort, in place. The farthest left goes to the end of what's left.
+    for (size_t n = list->size; n > 1; n--) {
+        VPEntry last = entries[n - 1];
+        vpt_idx_t last_index = indices ? indices[n - 1] : 0;
+        entries[n - 1] = entries[0];
+        if (indices) indices[n - 1] = indices[0];
+        size_t i = __VPT_knnheap_sift_down(entries, indices, n - 1, 0, last.distance);
+        entries[i] = last;
+        if (indices) indices[i] = last_index;
+    }
+    assert_knnlist_sorted(entries, list->size);
+}
 
-    // Split the list in half using the root as a vantage point.
-    // Sort the list by distance to the root
-    for (i = 0; i < num_entries; i++)
-        entry_list[i].distance = dist_fn(extra_data, entry_list[i].item, sort_by);
-    VPSort(entry_list, num_entries, scratch_space);
-    LOGs("Entry list sorted.");
-
-    // Find median item and record position, splitting the list in (roughly) half.
-    // Look backward for identical elements, and go forward until you're free of them.
-    // This way, the right list is strictly greater than the left list.
-    right_num_children = num_entries / 2;
-    right_children = entry_list + (num_entries - right_num_children);
-    while (right_children->distance == (right_children - 1)->distance) {
-        --right_children;
-        ++right_num_children;
-    }
-    left_num_children = num_entries - right_num_children;
-    left_children = entry_list;
-
-    // Set the node.
-    newnode = __alloc_VPNode(&(vpt->allocator));
-    if (!newnode) return false;
-    newnode->ulabel = 'b';
-    newnode->u.branch.item = sort_by;
-    newnode->u.branch.radius = (right_children - 1)->distance;
-    vpt->root = newnode;
-
-    // Push onto the stack the work that needs to be done to create the left and right of the root.
-    leftstack[0].children = left_children;
-    leftstack[0].num_children = left_num_children;
-    leftstack[0].parent = newnode;
-    left_stacksize++;
-    rightstack[0].children = right_children;
-    rightstack[0].num_children = right_num_children;
-    rightstack[0].parent = newnode;
-    right_stacksize++;
-
-    LOGs("Finished initializing the stack.");
-
-    // Now build the rest of the tree off the root. Push the information for the nodes
-    // that still need to be created onto the stacks, and keep taking from them until
-    // we're done.
-    while (left_stacksize || right_stacksize) {
-        if (left_stacksize) {
-            popped = leftstack[--left_stacksize];
-            LOG("Popped %lu off left stack\n", popped.num_children);
-            /*******************/
-            /* Build left node */
-            /*******************/
-
-            // Base case, build list and don't push.
-            // This list is exactly sized, but can be realloced later.
-            if (popped.num_children < VPT_BUILD_LIST_THRESHOLD) {
-                newnode = __alloc_VPNode(&(vpt->allocator));
-                if (!newnode) return false;
-                newnode->ulabel = 'l';
-                newnode->u.pointlist.size = newnode->u.pointlist.capacity = popped.num_children;
-                newnode->u.pointlist.items = __alloc_VPList(&(vpt->allocator), popped.num_children);
-                if (!newnode->u.pointlist.items) return false;
-                for (i = 0; i < popped.num_children; i++) {
-                    newnode->u.pointlist.items[i] = popped.children[i].item;
-                }
-                popped.parent->u.branch.left = newnode;
-                LOGs("Created leaf.");
-            }
-
-            // Inductive case, build node and push more information
-            else {
-                newnode = __alloc_VPNode(&(vpt->allocator));
-                if (!newnode) return false;
-
-                // Pop the first child off the list and into the new node
-                sort_by = popped.children[0].item;
-                entry_list = (popped.children + 1);
-                num_entries = (popped.num_children - 1);
-
-                // Sort the entries by the popped node
-                for (i = 0; i < num_entries; i++)
-                    entry_list[i].distance =
-                        dist_fn(extra_data, sort_by, entry_list[i].item);
-                VPSort(entry_list, num_entries, scratch_space);
-
-                // Split the list of entries by the median.
-                right_num_children = num_entries / 2;
-                right_children = entry_list + (num_entries - right_num_children);
-                while (right_children->distance == (right_children - 1)->distance) {
-                    --right_children;
-                    ++right_num_children;
-                }
-                left_num_children = num_entries - right_num_children;
-                left_children = entry_list;
-                LOG("Number of left children: %lu\n", left_num_children);
-                LOG("Number of right children: %lu\n", right_num_children);
-
-                // Set the information in the node. The node's radius is the distance of the
-                // final element of the left list, such that left <= radius < right.
-                newnode->ulabel = 'b';
-                newnode->u.branch.item = sort_by;
-                newnode->u.branch.radius = (right_children - 1)->distance;
-
-                // Connect the node to its parent
-                popped.parent->u.branch.left = newnode;
-
-                // Push the lists and the relevant information for building the next left and
-                // right of this node onto the stack
-                leftstack[left_stacksize].children = left_children;
-                leftstack[left_stacksize].num_children = left_num_children;
-                leftstack[left_stacksize].parent = newnode;
-                ++left_stacksize;
-                rightstack[right_stacksize].children = right_children;
-                rightstack[right_stacksize].num_children = right_num_children;
-                rightstack[right_stacksize].parent = newnode;
-                ++right_stacksize;
-                LOGs("Created branch.");
-            }
-        } else {
-            popped = rightstack[--right_stacksize];
-            LOG("Popped %lu off right stack\n", popped.num_children);
-            /********************/
-            /* Build right node */
-            /********************/
-
-            if (popped.num_children < VPT_BUILD_LIST_THRESHOLD) {
-                newnode = __alloc_VPNode(&(vpt->allocator));
-                if (!newnode) return false;
-
-                newnode->ulabel = 'l';
-                newnode->u.pointlist.size = popped.num_children;
-                newnode->u.pointlist.capacity = popped.num_children;
-                newnode->u.pointlist.items = __alloc_VPList(&(vpt->allocator), popped.num_children);
-                for (i = 0; i < popped.num_children; i++) {
-                    newnode->u.pointlist.items[i] = popped.children[i].item;
-                }
-                popped.parent->u.branch.right = newnode;
-                LOGs("Created leaf.");
-            }
-
-            // Inductive case, build node and push more information
-            else {
-                newnode = __alloc_VPNode(&(vpt->allocator));
-                if (!newnode) return false;
-
-                // Pop the first child off the list and into the new node
-                sort_by = popped.children[0].item;
-                entry_list = (popped.children + 1);
-                num_entries = (popped.num_children - 1);
-
-                // Sort the entries by the popped node
-                for (i = 0; i < num_entries; i++)
-                    entry_list[i].distance =
-                        dist_fn(extra_data, sort_by, entry_list[i].item);
-                VPSort(entry_list, num_entries, scratch_space);
-
-                // Split the list of entries by the median.
-                right_num_children = num_entries / 2;
-                right_children = entry_list + (num_entries - right_num_children);
-                while (right_children->distance == (right_children - 1)->distance) {
-                    --right_children;
-                    ++right_num_children;
-                }
-                left_num_children = num_entries - right_num_children;
-                left_children = entry_list;
-                LOG("Number of left children: %lu\n", left_num_children);
-                LOG("Number of right children: %lu\n", right_num_children);
+// Queries walk the tree with a stack of the nodes left to visit. Each branch 
+// popped pushes at most its two children, so apart from a pair of siblings on 
+// top, the stack holds at most one node per level, and never more than 
+// height + 1 nodes. Multi-vantage-point branches push up to fanout * fanout, 
+// leaving that many less one per level. Returns stack_buffer (which has room 
+// for VPT_MAX_HEIGHT) when the tree is short enough, or a stack on the heap 
+// when it isn't. Returns NULL if out of memory.
+static inline size_t
+__VPT_traversal_stack_size(VPTree* vpt) {
+    size_t fanout = vpt->config.mvp_fanout;
+    size_t num_children = fanout ? fanout * fanout : 2;
+    return vpt->height * (num_children - 1) + 1;
+}
+
+static inline NodeDistTuple*
+__VPT_traversal_stack(VPTree* vpt, NodeDistTuple* stack_buffer) {
+    size_t stack_size = __VPT_traversal_stack_size(vpt);
+    if (stack_size <= VPT_MAX_HEIGHT) return stack_buffer;
+    return (NodeDistTuple*)malloc(stack_size * sizeof(NodeDistTuple));
+}
+
+static inline void
+__VPT_free_traversal_stack(NodeDistTuple* to_traverse, NodeDistTuple* stack_buffer) {
+    if (to_traverse != stack_buffer) free(to_traverse);
+}
+
+// By the triangle inequality, an item of a leaf is at least this far from the 
+// query, given their distances to the vantage point of the leaf's parent.
+static inline dist_t
+__VPT_dist_lower_bound(dist_t query_dist, dist_t item_dist) {
+    return query_dist > item_dist ? query_dist - item_dist : item_dist - query_dist;
+}
 
-                newnode->ulabel = 'b';
-                newnode->u.branch.item = sort_by;
-                newnode->u.branch.radius = (right_children - 1)->distance;
+// By the triangle inequality, everything whose distance to a vantage point is 
+// in [shell_min, shell_max] is at least this far from a query that is
+// query_dist from the vantage point.
+static inline dist_t
+__VPT_shell_lower_bound(dist_t query_dist, dist_t shell_min, dist_t shell_max) {
+    if (query_dist < shell_min) return shell_min - query_dist;
+    if (query_dist > shell_max) return query_dist - shell_max;
+    return 0;
+}
 
-                // Connect the node to its parent
-                popped.parent->u.branch.right = newnode;
+// Everything in a child of a multi-vantage-point branch is in the shells 
+// around both of its vantage points, so it's at least the farther of the 
+// two bounds away from the query.
+static inline dist_t
+__VPT_multi_lower_bound(VPMultiChild* child, dist_t first_dist, dist_t second_dist) {
+    dist_t first_bound = __VPT_shell_lower_bound(first_dist, child->min[0], child->max[0]);
+    dist_t second_bound = __VPT_shell_lower_bound(second_dist, child->min[1], child->max[1]);
+    return first_bound > second_bound ? first_bound : second_bound;
+}
 
-                // Push the lists and the relevant information for building the next left and
-                // right of this node onto the stack
-                leftstack[left_stacksize].children = left_children;
-                leftstack[left_stacksize].num_children = left_num_children;
-                leftstack[left_stacksize].parent = newnode;
-                ++left_stacksize;
-                rightstack[right_stacksize].children = right_children;
-                rightstack[right_stacksize].num_children = right_num_children;
-                rightstack[right_stacksize].parent = newnode;
-                ++right_stacksize;
-                LOGs("Created branch.");
-            }
-        }
+/********************/
+/* Query Statistics */
+/********************/
+
+// Queries count what they do with these macros, which expand to nothing 
+// unless VPT_STATS is #defined. __VPT_STATS_BEGIN declares the counters, 
+// and __VPT_STATS_END records them once the query is done. Until then, 
+// subtrees_pruned counts the children of the branches visited.
+#ifdef VPT_STATS
+#define __VPT_STATS_BEGIN VPTQueryStats __vpt_stats = {0, 0, 0, 0, 0}
+#define __VPT_STAT(field, n) (__vpt_stats.field += (n))
+#define __VPT_STAT_STACK(size) \
+    if ((size) > __vpt_stats.max_stack_depth) __vpt_stats.max_stack_depth = (size)
+#define __VPT_STATS_END(vpt) __VPT_record_stats((vpt), &__vpt_stats)
+#define __VPT_STATS_RESET(vpt) VPT_reset_stats(vpt)
+#else
+#define __VPT_STATS_BEGIN
+#define __VPT_STAT(field, n)
+#define __VPT_STAT_STACK(size)
+#define __VPT_STATS_END(vpt)
+#define __VPT_STATS_RESET(vpt)
+#endif
+
+#ifdef VPT_STATS
+// The stats of the last query on each thread.
+static _Thread_local VPTQueryStats __VPT_last_stats;
+
+static inline void
+__VPT_record_stats(VPTree* vpt, VPTQueryStats* stats) {
+    // Every child of a branch visited that wasn't visited itself was pruned.
+    stats->subtrees_pruned = stats->subtrees_pruned + 1 - stats->branches_visited - stats->leaves_scanned;
+    __VPT_last_stats = *stats;
+
+    VPTreeStats* totals = &(vpt->stats);
+    atomic_fetch_add_explicit(&(totals->num_queries), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(totals->dist_calls), stats->dist_calls, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(totals->branches_visited), stats->branches_visited, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(totals->leaves_scanned), stats->leaves_scanned, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(totals->subtrees_pruned), stats->subtrees_pruned, memory_order_relaxed);
+    size_t max_depth = atomic_load_explicit(&(totals->max_stack_depth), memory_order_relaxed);
+    while (stats->max_stack_depth > max_depth &&
+           !atomic_compare_exchange_weak_explicit(&(totals->max_stack_depth), &max_depth, stats->max_stack_depth,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
     }
+}
 
-    free(scratch_space);
-    free(build_buffer);
-    return true;
+/**
+ * Gets the stats of the last query made by the calling thread, with VPT_knn(),
+ * VPT_knn_approx(), VPT_nn(), VPT_all_within(), VPT_within_visit(), or 
+ * VPT_count_within(). Each query of a batch is made by one of the threads 
+ * of the batch, so batches don't update the stats of the calling thread. 
+ * Only available when VPT_STATS is #defined.
+ * 
+ * @param stats Where to write the stats.
+ */
+static inline void
+VPT_last_query_stats(VPTQueryStats* stats) {
+    *stats = __VPT_last_stats;
 }
 
 /**
- * @return The size of this VPTree (The number of datapoints stored within this VPTree).
+ * Gets the stats of every query made on the tree since it was built or the 
+ * stats were reset, from any thread. Only available when VPT_STATS is #defined.
+ * 
+ * @param vpt The tree to get the stats of.
+ * @param num_queries Set to the number of queries made.
+ * @param totals Set to the sum of the stats of every query, except for 
+ *               max_stack_depth, which is the largest of any query.
  */
-static inline size_t
-VPT_size(VPTree* vpt) {
-    return vpt->size;
+static inline void
+VPT_stats(VPTree* vpt, size_t* num_queries, VPTQueryStats* totals) {
+    VPTreeStats* stats = &(vpt->stats);
+    *num_queries = atomic_load(&(stats->num_queries));
+    totals->dist_calls = atomic_load(&(stats->dist_calls));
+    totals->branches_visited = atomic_load(&(stats->branches_visited));
+    totals->leaves_scanned = atomic_load(&(stats->leaves_scanned));
+    totals->subtrees_pruned = atomic_load(&(stats->subtrees_pruned));
+    totals->max_stack_depth = atomic_load(&(stats->max_stack_depth));
 }
 
 /**
- * Frees the resources owned by this VPTree. 
- *
- * The VPTree is not usable after this function is called. However, you can reuse 
- * the struct to build a new one via VPT_build. 
+ * Zeroes the stats VPT_stats() reports. Building the tree does too. Only 
+ * available when VPT_STATS is #defined.
  * 
- * @param vpt The Vantage Point Tree to destroy.
+ * @param vpt The tree to reset the stats of.
  */
 static inline void
-VPT_destroy(VPTree* vpt) {
-    NodeAllocs* node_allocs = vpt->allocator.node_allocs;
-    while (node_allocs) {
-        NodeAllocs* consumed_node_allocs = node_allocs;
-        node_allocs = node_allocs->next;
-        free(consumed_node_allocs);
+VPT_reset_stats(VPTree* vpt) {
+    VPTreeStats* stats = &(vpt->stats);
+    atomic_store(&(stats->num_queries), 0);
+    atomic_store(&(stats->dist_calls), 0);
+    atomic_store(&(stats->branches_visited), 0);
+    atomic_store(&(stats->leaves_scanned), 0);
+    atomic_store(&(stats->subtrees_pruned), 0);
+    atomic_store(&(stats->max_stack_depth), 0);
+}
+#endif
+
+/**************/
+/* Tree Build */
+/**************/
+
+// Splits entry_list (roughly) in half around the median distance, such that 
+// the entries that end up on the left are <= radius, and the entries on the 
+// right are > radius. Returns the number of entries on the left.
+//
+// Entries the same distance as the median all have to go to the same side.
+// They go right if there's anything closer, otherwise left.
+static inline size_t
+__VPT_split(VPBuildKey* entry_list, size_t num_entries, dist_t* radius,
+            VPBuildKey* scratch_space, VPSortPool* sort_pool, size_t sort_threshold,
+            bool median_selection) {
+    size_t i, median = num_entries - (num_entries / 2);
+    size_t num_less, num_equal;
+
+    if (median_selection) {
+        // Select the median, then gather the entries the same distance as it
+        // on either side of it.
+        VPSelect(entry_list, num_entries, median);
+        dist_t median_dist = entry_list[median].distance;
+        num_less = __select_equal_to_back(entry_list, median, median_dist);
+        if (num_less) {
+            *radius = entry_list[0].distance;
+            for (i = 1; i < num_less; i++)
+                if (entry_list[i].distance > *radius) *radius = entry_list[i].distance;
+            return num_less;
+        }
+        num_equal = __select_equal_to_front(entry_list + median, num_entries - median, median_dist);
+        *radius = median_dist;
+        return median + num_equal;
     }
 
-    ListAllocs* list_allocs = vpt->allocator.list_allocs;
-    while (list_allocs) {
-        ListAllocs* consumed_list_allocs = list_allocs;
-        list_allocs = list_allocs->next;
-        free(consumed_list_allocs);
+    // Sort the entries, find the median, then look backward for identical 
+    // elements, and go forward until you're free of them.
+    VPSort(entry_list, num_entries, scratch_space, sort_pool, sort_threshold);
+    for (num_less = median; num_less; num_less--)
+        if (entry_list[num_less - 1].distance != entry_list[median].distance) break;
+    if (num_less) {
+        *radius = entry_list[num_less - 1].distance;
+        return num_less;
     }
+    for (i = median + 1; i < num_entries; i++)
+        if (entry_list[i].distance != entry_list[median].distance) break;
+    *radius = entry_list[median].distance;
+    return i;
+}
 
-    LOGs("Tree destruction complete.");
+// Finds the smallest and largest distances in a list of entries. 
+// If there are none, min is DIST_MAX and max is 0.
+static inline void
+__VPT_shell(VPBuildKey* entry_list, size_t num_entries, dist_t* min_dist, dist_t* max_dist) {
+    *min_dist = (dist_t) DIST_MAX;
+    *max_dist = 0;
+    for (size_t i = 0; i < num_entries; i++) {
+        if (entry_list[i].distance < *min_dist) *min_dist = entry_list[i].distance;
+        if (entry_list[i].distance > *max_dist) *max_dist = entry_list[i].distance;
+    }
 }
 
-/**
- * Frees the resources owned by this VPTree, and returns 
- * a buffer containing all the items that were inside. 
- * The size of the buffer returned is the same as vpt->size.
- * 
- * The VPTree is not usable after this function is called. However, you can reuse 
- * the struct to build a new one via VPT_build. Until you do so, you can also access
- * the previous size of the tree through vpt->size.
- * 
- * The buffer of items returned by this function is allocated with malloc() 
- * and must be freed. 
- * 
- * @param vpt The Vantage Point Tree to destroy.
- * @return The items that were contained in the tree, or NULL if out of memory.
- *             If this method returns null (there's not enough memory to 
- *             allocate the buffer to return), the tree will not be destroyed 
- *             and will remain usable.
- */
-static inline vpt_t*
+// SplitMix64. Small, fast, and good enough to pick vantage points with.
+static inline uint64_t
+__VPT_rand(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Returns the index into frame.children of the item that should become 
+// the vantage point of the node being built from the frame. 
+static inline size_t
+__VPT_choose_vantage_point(VPBuild* build, VPBuildStackFrame frame) {
+    VPTree* vpt = build->vpt;
+    size_t i, j, best = 0, n = frame.num_children;
+
+    // Seed from the frame's position in the build buffer rather than from 
+    // shared state, so the choice doesn't depend on which thread builds it.
+    uint64_t rng = vpt->config.vp_seed ^ (uint64_t)(frame.children - build->build_buffer);
+    __VPT_rand(&rng);
+
+    switch (vpt->config.vp_strategy) {
+    case VPT_VP_RANDOM:
+        return __VPT_rand(&rng) % n;
+
+    case VPT_VP_SAMPLE_SPREAD: {
+        size_t sample_size = min(min(vpt->config.vp_sample_size, VPT_MAX_VP_SAMPLE_SIZE), n);
+        if (sample_size < 2) return 0;
+        dist_t best_spread = -1;
+        dist_t dists[VPT_MAX_VP_SAMPLE_SIZE];
+        for (i = 0; i < sample_size; i++) {
+            size_t candidate = __VPT_rand(&rng) % n;
+            for (j = 0; j < sample_size; j++) {
+                vpt_t other = build->data[frame.children[__VPT_rand(&rng) % n].index];
+                dists[j] = vpt->dist_fn(vpt->extra_data, build->data[frame.children[candidate].index], other);
+            }
+
+            // The spread is the second moment of the distances about their median.
+            dist_t sorted[VPT_MAX_VP_SAMPLE_SIZE];
+            for (j = 0; j < sample_size; j++) {
+                size_t k = j;
+                for (; k && sorted[k - 1] > dists[j]; k--) sorted[k] = sorted[k - 1];
+                sorted[k] = dists[j];
+            }
+            dist_t median = sorted[sample_size / 2], spread = 0;
+            for (j = 0; j < sample_size; j++)
+                spread += (dists[j] - median) * (dists[j] - median);
+
+            if (spread > best_spread) {
+                best_spread = spread;
+                best = candidate;
+            }
+        }
+        return best;
+    }
+
+    case VPT_VP_FARTHEST_FROM_PARENT:
+        // The root has no parent, so measure from the first item instead.
+        if (frame.dest == &(vpt->root)) {
+            vpt_t first = build->data[frame.children[0].index];
+            for (i = 1; i < n; i++)
+                frame.children[i].distance = vpt->dist_fn(vpt->extra_data, first, build->data[frame.children[i].index]);
+            frame.children[0].distance = 0;
+        }
+        for (i = 1; i < n; i++)
+            if (frame.children[i].distance > frame.children[best].distance) best = i;
+        return best;
+
+    case VPT_VP_FIRST:
+    default:
+        return 0;
+    }
+}
+
+// Splits entry_list into num_parts runs of (nearly) the same length, ordered 
+// by distance, such that nothing in a run is closer than anything in the runs 
+// before it. Run i is [i * num_entries / num_parts, (i + 1) * num_entries / num_parts).
+// Unlike __VPT_split(), entries the same distance can end up in different runs.
+static inline void
+__VPT_partition(VPBuild* build, VPBuildKey* entry_list, size_t num_entries, size_t num_parts) {
+    VPTree* vpt = build->vpt;
+    if (vpt->config.median_selection) {
+        // Select the start of each run in turn, in what's left after the last.
+        size_t start = 0;
+        for (size_t i = 1; i < num_parts; i++) {
+            size_t cut = i * num_entries / num_parts;
+            if (cut > start && cut < num_entries) VPSelect(entry_list + start, num_entries - start, cut - start);
+            start = cut;
+        }
+    } else {
+        VPBuildKey* scratch_space = NULL;
+        if (build->scratch_space) scratch_space = build->scratch_space + (entry_list - build->build_buffer);
+        VPSort(entry_list, num_entries, scratch_space, build->sort_pool, vpt->config.sort_threshold);
+    }
+}
+
+// Builds newnode as a multi-vantage-point branch out of the frame popped, and 
+// writes the frames for building its children to next. popped needs at least 
+// mvp_fanout * mvp_fanout + 2 children, so that none of its children are empty.
+static inline bool
+__VPT_build_multi(VPBuild* build, VPAllocator* allocator, VPBuildStackFrame popped, VPNode* newnode,
+                  VPBuildStackFrame* next, size_t* num_next) {
+    VPTree* vpt = build->vpt;
+    size_t i, j, fanout = vpt->config.mvp_fanout;
+    VPMultiChild* children = __alloc_VPMultiChildren(allocator, fanout * fanout);
+    if (!children) return false;
+
+    // Pick the first vantage point the same way as for a binary branch, and 
+    // the second as the item farthest from it, so they see the items from 
+    // different sides. Move them to the front of the list.
+    i = __VPT_choose_vantage_point(build, popped);
+    VPBuildKey vantage_point = popped.children[i];
+    popped.children[i] = popped.children[0];
+    popped.children[0] = vantage_point;
+    vpt_t first = build->data[vantage_point.index];
+    VPBuildKey* entry_list = popped.children + 1;
+    size_t num_entries = popped.num_children - 1, farthest = 0;
+    for (i = 0; i < num_entries; i++) {
+        entry_list[i].distance = vpt->dist_fn(vpt->extra_data, first, build->data[entry_list[i].index]);
+        if (entry_list[i].distance > entry_list[farthest].distance) farthest = i;
+    }
+    vantage_point = entry_list[farthest];
+    entry_list[farthest] = entry_list[0];
+    entry_list[0] = vantage_point;
+    vpt_t second = build->data[vantage_point.index];
+    entry_list++;
+    num_entries--;
+
+    newnode->ulabel = 'm';
+    newnode->u.multi.items[0] = first;
+    newnode->u.multi.items[1] = second;
+    newnode->u.multi.children = children;
+    newnode->u.multi.fanout = fanout;
+    *popped.dest = newnode;
+
+    // Split by the distance to the first vantage point, then split each part 
+    // by the distance to the second. The children's keys are left holding 
+    // the distances to the second, which is what their own nodes need.
+    __VPT_partition(build, entry_list, num_entries, fanout);
+    for (i = 0; i < fanout; i++) {
+        size_t part_start = i * num_entries / fanout;
+        size_t part_size = (i + 1) * num_entries / fanout - part_start;
+        VPBuildKey* part = entry_list + part_start;
+        dist_t min_first, max_first;
+        __VPT_shell(part, part_size, &min_first, &max_first);
+
+        for (j = 0; j < part_size; j++)
+            part[j].distance = vpt->dist_fn(vpt->extra_data, second, build->data[part[j].index]);
+        __VPT_partition(build, part, part_size, fanout);
+
+        for (j = 0; j < fanout; j++) {
+            size_t child_start = j * part_size / fanout;
+            size_t child_size = (j + 1) * part_size / fanout - child_start;
+            VPMultiChild* child = children + (i * fanout + j);
+            child->min[0] = min_first;
+            child->max[0] = max_first;
+            __VPT_shell(part + child_start, child_size, &(child->min[1]), &(child->max[1]));
+
+            VPBuildStackFrame* frame = next + (i * fanout + j);
+            frame->dest = &(child->node);
+            frame->children = part + child_start;
+            frame->num_children = child_size;
+            frame->depth = popped.depth + 1;
+        }
+    }
+    *num_next = fanout * fanout;
+    LOGs("Created multi-vantage-point branch.");
+    return true;
+}
+
+// Builds the node described by popped and links it into the tree. If the node 
+// becomes a branch, the frames for building its subtrees are written to next, 
+// which needs room for __VPT_MAX_CHILDREN of them, and num_next is set to how 
+// many there are. Otherwise num_next is set to 0. Returns false if out of memory.
+static inline bool
+__VPT_build_frame(VPBuild* build, VPAllocator* allocator, VPBuildStackFrame popped,
+                  VPBuildStackFrame* next, size_t* num_next) {
+    VPTree* vpt = build->vpt;
+    size_t i;
+    *num_next = 0;
+
+    VPNode* newnode = __alloc_VPNode(allocator);
+    if (!newnode) return false;
+
+    // Base case, build list and don't push.
+    // This list is exactly sized, but can be realloced later.
+    if (popped.num_children < vpt->config.leaf_size) {
+        newnode->ulabel = 'l';
+        newnode->u.pointlist.size = newnode->u.pointlist.capacity = popped.num_children;
+        newnode->u.pointlist.items = __alloc_VPList(allocator, popped.num_children);
+        if (!newnode->u.pointlist.items) return false;
+        for (i = 0; i < popped.num_children; i++) {
+            newnode->u.pointlist.items[i] = build->data[popped.children[i].index];
+        }
+
+        // The keys of every node but the root hold the distances to their parent's vantage point.
+        newnode->u.pointlist.distances = NULL;
+        if (vpt->config.leaf_distances && popped.dest != &(vpt->root)) {
+            newnode->u.pointlist.distances = __alloc_VPDistList(allocator, popped.num_children);
+            if (!newnode->u.pointlist.distances) return false;
+            for (i = 0; i < popped.num_children; i++)
+                newnode->u.pointlist.distances[i] = popped.children[i].distance;
+        }
+        *popped.dest = newnode;
+        LOGs("Created leaf.");
+        return true;
+    }
+
+    // Inductive case, build node and push more information.
+    size_t fanout = vpt->config.mvp_fanout;
+    if (fanout && popped.num_children >= fanout * fanout + 2)
+        return __VPT_build_multi(build, allocator, popped, newnode, next, num_next);
+
+    // Pick the vantage point, then pop it off the list and into the new node.
+    i = __VPT_choose_vantage_point(build, popped);
+    VPBuildKey vantage_point = popped.children[i];
+    popped.children[i] = popped.children[0];
+    popped.children[0] = vantage_point;
+    vpt_t sort_by = build->data[vantage_point.index];
+    VPBuildKey* entry_list = (popped.children + 1);
+    size_t num_entries = (popped.num_children - 1);
+
+    // Calculate the distance from the popped node to each entry.
+    for (i = 0; i < num_entries; i++)
+        entry_list[i].distance = vpt->dist_fn(vpt->extra_data, sort_by, build->data[entry_list[i].index]);
+
+    // Split the list in (roughly) half by the median distance. Every frame owns 
+    // a disjoint part of the build buffer, so it can use the same part of the 
+    // scratch space, if there is one.
+    dist_t radius;
+    VPBuildKey* scratch_space = NULL;
+    if (build->scratch_space) scratch_space = build->scratch_space + (entry_list - build->build_buffer);
+    size_t left_num_children = __VPT_split(entry_list, num_entries, &radius, scratch_space, build->sort_pool,
+                                           vpt->config.sort_threshold, vpt->config.median_selection);
+    size_t right_num_children = num_entries - left_num_children;
+    VPBuildKey* left_children = entry_list;
+    VPBuildKey* right_children = entry_list + left_num_children;
+    LOG("Number of left children: %lu\n", left_num_children);
+    LOG("Number of right children: %lu\n", right_num_children);
+
+    // Set the information in the node. The node's radius is the distance of the
+    // final element of the left list, such that left <= radius < right. The 
+    // rest of the bounds on each side let queries prune more tightly.
+    dist_t left_max;
+    newnode->ulabel = 'b';
+    newnode->u.branch.item = sort_by;
+    newnode->u.branch.radius = radius;
+    __VPT_shell(left_children, left_num_children, &(newnode->u.branch.left_min), &left_max);
+    __VPT_shell(right_children, right_num_children, &(newnode->u.branch.right_min), &(newnode->u.branch.right_max));
+
+    // Connect the node to its parent
+    *popped.dest = newnode;
+
+    // Return the information for building the left and right of this node.
+    next[0].dest = &(newnode->u.branch.left);
+    next[0].children = left_children;
+    next[0].num_children = left_num_children;
+    next[0].depth = popped.depth + 1;
+    next[1].dest = &(newnode->u.branch.right);
+    next[1].children = right_children;
+    next[1].num_children = right_num_children;
+    next[1].depth = popped.depth + 1;
+    *num_next = 2;
+    LOGs("Created branch.");
+    return true;
+}
+
+// Builds the whole subtree described by frame on the calling thread. Raises 
+// height to the depth of the deepest node built, if that's deeper.
+static inline bool
+__VPT_build_subtree(VPBuild* build, VPAllocator* allocator, VPBuildStackFrame frame, size_t* height) {
+    // Hold information about the nodes that still need to be created. Push the 
+    // right child before the left, so that the left subtree is built first and
+    // at most one frame per level of the tree is waiting on the stack (or 
+    // mvp_fanout * mvp_fanout - 1, for multi-vantage-point branches). Duplicate 
+    // heavy data can still make the tree very deep, so move the stack to the 
+    // heap if it outgrows the one on the C stack.
+    VPBuildStackFrame stack_buffer[VPT_MAX_HEIGHT];
+    VPBuildStackFrame* stack = stack_buffer;
+    VPBuildStackFrame next[__VPT_MAX_CHILDREN];
+    size_t stacksize = 1, stack_capacity = VPT_MAX_HEIGHT, num_next;
+    bool success = true;
+    stack[0] = frame;
+
+    while (stacksize) {
+        VPBuildStackFrame popped = stack[--stacksize];
+        LOG("Popped %lu off the build stack\n", popped.num_children);
+        if (popped.depth > *height) *height = popped.depth;
+        if (!__VPT_build_frame(build, allocator, popped, next, &num_next)) {
+            success = false;
+            break;
+        }
+
+        if (stacksize + num_next > stack_capacity) {
+            VPBuildStackFrame* new_stack = (VPBuildStackFrame*)malloc(2 * stack_capacity * sizeof(VPBuildStackFrame));
+            if (!new_stack) {
+                success = false;
+                break;
+            }
+            for (size_t i = 0; i < stacksize; i++) new_stack[i] = stack[i];
+            if (stack != stack_buffer) free(stack);
+            stack = new_stack;
+            stack_capacity *= 2;
+        }
+        while (num_next) stack[stacksize++] = next[--num_next];
+    }
+
+    if (stack != stack_buffer) free(stack);
+    return success;
+}
+
+// Wakes one idle worker, or all of them, to look again for work, or for 
+// whether the build is over.
+static inline void
+__VPT_build_wake(VPBuild* build, bool all) {
+    pthread_mutex_lock(&(build->idle_lock));
+    atomic_fetch_add(&(build->num_wakes), 1);
+    if (all) pthread_cond_broadcast(&(build->wake));
+    else pthread_cond_signal(&(build->wake));
+    pthread_mutex_unlock(&(build->idle_lock));
+}
+
+// Pushes a frame onto a worker's deque, and wakes an idle worker to take it.
+static inline bool
+__VPT_deque_push(VPBuild* build, VPBuildDeque* deque, VPBuildStackFrame frame) {
+    bool success = true;
+    pthread_mutex_lock(&(deque->lock));
+    if (deque->back == deque->capacity) {
+        size_t new_capacity = deque->capacity ? 2 * deque->capacity : VPT_MAX_HEIGHT;
+        VPBuildStackFrame* new_frames = (VPBuildStackFrame*)realloc(deque->frames, new_capacity * sizeof(VPBuildStackFrame));
+        if (new_frames) {
+            deque->frames = new_frames;
+            deque->capacity = new_capacity;
+        } else {
+            success = false;
+        }
+    }
+    if (success) deque->frames[deque->back++] = frame;
+    pthread_mutex_unlock(&(deque->lock));
+    if (success) __VPT_build_wake(build, false);
+    return success;
+}
+
+// The owner takes the newest frame, which is the smallest and the most likely to be in cache.
+static inline bool
+__VPT_deque_pop(VPBuildDeque* deque, VPBuildStackFrame* frame) {
+    bool found = false;
+    pthread_mutex_lock(&(deque->lock));
+    if (deque->back > deque->front) {
+        *frame = deque->frames[--deque->back];
+        found = true;
+    }
+    if (deque->back == deque->front) deque->back = deque->front = 0;
+    pthread_mutex_unlock(&(deque->lock));
+    return found;
+}
+
+// Thieves take the oldest frame, which is the largest piece of work available.
+static inline bool
+__VPT_deque_steal(VPBuildDeque* deque, VPBuildStackFrame* frame) {
+    bool found = false;
+    pthread_mutex_lock(&(deque->lock));
+    if (deque->back > deque->front) {
+        *frame = deque->frames[deque->front++];
+        found = true;
+    }
+    if (deque->back == deque->front) deque->back = deque->front = 0;
+    pthread_mutex_unlock(&(deque->lock));
+    return found;
+}
+
+static void*
+__VPT_build_worker(void* arg) {
+    VPBuildWorker* self = (VPBuildWorker*)arg;
+    VPBuild* build = self->build;
+    VPBuildStackFrame popped;
+    VPBuildStackFrame next[__VPT_MAX_CHILDREN];
+    size_t num_next;
+
+    while (!atomic_load(&(build->failed))) {
+        // Take work from our own deque, or steal it from someone else's.
+        size_t num_wakes = atomic_load(&(build->num_wakes));
+        bool found = __VPT_deque_pop(&(self->deque), &popped);
+        for (size_t i = 1; !found && i < build->num_workers; i++) {
+            VPBuildWorker* victim = build->workers + ((self->id + i) % build->num_workers);
+            found = __VPT_deque_steal(&(victim->deque), &popped);
+        }
+
+        // If there's none, sleep until a frame is pushed, or the build is 
+        // over. Anything pushed since the search started has changed 
+        // num_wakes, so it can't be slept through.
+        if (!found) {
+            if (!atomic_load(&(build->pending))) break;
+            pthread_mutex_lock(&(build->idle_lock));
+            while (atomic_load(&(build->num_wakes)) == num_wakes && atomic_load(&(build->pending)) &&
+                   !atomic_load(&(build->failed)))
+                pthread_cond_wait(&(build->wake), &(build->idle_lock));
+            pthread_mutex_unlock(&(build->idle_lock));
+            continue;
+        }
+
+        // Small subtrees aren't worth sharing. Build them here.
+        bool success;
+        if (popped.num_children < VPT_PARALLEL_BUILD_GRAIN) {
+            success = __VPT_build_subtree(build, &(self->allocator), popped, &(self->height));
+        } else {
+            if (popped.depth > self->height) self->height = popped.depth;
+            success = __VPT_build_frame(build, &(self->allocator), popped, next, &num_next);
+            // Count the children as pending before this frame stops being, 
+            // so that the other threads don't see zero and quit early.
+            for (size_t i = 0; success && i < num_next; i++) {
+                atomic_fetch_add(&(build->pending), 1);
+                success = __VPT_deque_push(build, &(self->deque), next[i]);
+                if (!success) atomic_fetch_sub(&(build->pending), 1);
+            }
+        }
+        if (!success) atomic_store(&(build->failed), true);
+        if (atomic_fetch_sub(&(build->pending), 1) == 1 || !success) __VPT_build_wake(build, true);
+    }
+    return NULL;
+}
+
+// Builds the subtree described by frame using num_threads threads, including 
+// the calling one. Each thread builds into its own allocator, which are all 
+// handed over to the tree's allocator once the build is finished. Raises 
+// height the same way as __VPT_build_subtree().
+static inline bool
+__VPT_build_parallel(VPBuild* build, VPBuildStackFrame frame, size_t num_threads, size_t* height) {
+    build->num_workers = num_threads;
+    atomic_init(&(build->pending), 1);
+    atomic_init(&(build->failed), false);
+    atomic_init(&(build->num_wakes), 0);
+    build->workers = (VPBuildWorker*)malloc(num_threads * sizeof(VPBuildWorker));
+    if (!build->workers) return false;
+    pthread_mutex_init(&(build->idle_lock), NULL);
+    pthread_cond_init(&(build->wake), NULL);
+
+    size_t i, num_ready = 0;
+    bool success = true;
+    for (i = 0; i < num_threads; i++) {
+        VPBuildWorker* worker = build->workers + i;
+        worker->build = build;
+        worker->id = i;
+        worker->height = 0;
+        worker->deque.frames = NULL;
+        worker->deque.front = worker->deque.back = worker->deque.capacity = 0;
+        if (!__VPT_init_allocator(&(worker->allocator))) {
+            success = false;
+            break;
+        }
+        pthread_mutex_init(&(worker->deque.lock), NULL);
+        num_ready++;
+    }
+    if (success) success = __VPT_deque_push(build, &(build->workers[0].deque), frame);
+
+    if (success) {
+        // If a thread can't be started, the threads that did start pick up its share.
+        size_t num_started = 1;
+        for (i = 1; i < num_threads; i++, num_started++) {
+            if (pthread_create(&(build->workers[i].thread), NULL, __VPT_build_worker, build->workers + i))
+                break;
+        }
+        __VPT_build_worker(build->workers);
+        for (i = 1; i < num_started; i++)
+            pthread_join(build->workers[i].thread, NULL);
+        success = !atomic_load(&(build->failed));
+    }
+
+    for (i = 0; i < num_ready; i++) {
+        __VPT_splice_allocator(&(build->vpt->allocator), &(build->workers[i].allocator));
+        if (build->workers[i].height > *height) *height = build->workers[i].height;
+        pthread_mutex_destroy(&(build->workers[i].deque.lock));
+        free(build->workers[i].deque.frames);
+    }
+    pthread_cond_destroy(&(build->wake));
+    pthread_mutex_destroy(&(build->idle_lock));
+    free(build->workers);
+    return success;
+}
+
+// Builds the subtree of the num_items items of data that keys refer to, at 
+// the given depth in the tree, and links it in by writing it to dest. If the 
+// subtree isn't the whole tree, the distances in keys must be to the vantage 
+// point of its parent. Builds with the threads in the tree's config.
+static inline bool
+__VPT_build_keys(VPTree* vpt, vpt_t* data, VPBuildKey* keys, size_t num_items, VPNode** dest, size_t depth) {
+    VPBuild build;
+    build.vpt = vpt;
+    build.data = data;
+    build.build_buffer = keys;
+    build.sort_pool = NULL;
+
+    /* Allocate some space to help with sorting, and threads to sort with. 
+       If the threads can't be started, sort on the building threads instead. */
+    VPSortPool sort_pool;
+    if (!vpt->config.median_selection) {
+        build.scratch_space = (VPBuildKey*) malloc(max(num_items, 1) * sizeof(VPBuildKey));
+        if (!build.scratch_space) return false;
+        if (num_items >= vpt->config.sort_threshold && VPSortPool_create(&sort_pool, vpt->config.sort_threads))
+            build.sort_pool = &sort_pool;
+        LOGs("Allocated scratch space.");
+    } else {
+        build.scratch_space = NULL;
+    }
+
+    VPBuildStackFrame root_frame;
+    root_frame.dest = dest;
+    root_frame.children = keys;
+    root_frame.num_children = num_items;
+    root_frame.depth = depth;
+
+    size_t num_threads = vpt->config.build_threads;
+    if (!num_threads) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? (size_t)online : 1;
+    }
+
+    bool success;
+    if (num_threads == 1 || num_items < VPT_PARALLEL_BUILD_GRAIN) {
+        success = __VPT_build_subtree(&build, &(vpt->allocator), root_frame, &(vpt->height));
+    } else {
+        success = __VPT_build_parallel(&build, root_frame, num_threads, &(vpt->height));
+    }
+
+    if (build.sort_pool) VPSortPool_destroy(build.sort_pool);
+    free(build.scratch_space);
+    return success;
+}
+
+// The memory __VPT_build_keys() needs per item, counting the items themselves.
+static inline size_t
+__VPT_build_bytes_per_item(VPTree* vpt) {
+    size_t bytes = sizeof(vpt_t) + sizeof(VPBuildKey);
+    if (!vpt->config.median_selection) bytes += sizeof(VPBuildKey);
+    return bytes;
+}
+
+// Whether the spilled part of the tree with num_items items can be read back 
+// and built in memory. Leaves always are, since they have to be in memory anyway.
+static inline bool
+__VPT_spill_fits(VPTree* vpt, size_t num_items, size_t memory_budget) {
+    if (num_items < vpt->config.leaf_size) return true;
+    if (num_items - 1 > (size_t)(vpt_idx_t)-1) return false;
+    return num_items <= memory_budget / __VPT_build_bytes_per_item(vpt);
+}
+
+// Reads the items of a spilled part of the tree back into memory and builds it.
+static inline bool
+__VPT_build_spill_in_memory(VPTree* vpt, VPSpillFrame frame) {
+    vpt_t* data = (vpt_t*) malloc(max(frame.num_items, 1) * sizeof(vpt_t));
+    VPBuildKey* keys = (VPBuildKey*) malloc(max(frame.num_items, 1) * sizeof(VPBuildKey));
+    bool success = data && keys && !fseek(frame.file, 0, SEEK_SET);
+    for (size_t i = 0; success && i < frame.num_items; i++) {
+        VPEntry entry;
+        success = fread(&entry, sizeof(VPEntry), 1, frame.file) == 1;
+        if (!success) break;
+        data[i] = entry.item;
+        keys[i].distance = entry.distance;
+        keys[i].index = (vpt_idx_t)i;
+    }
+    if (success) success = __VPT_build_keys(vpt, data, keys, frame.num_items, frame.dest, frame.depth);
+    free(keys);
+    free(data);
+    return success;
+}
+
+// Splits a spilled part of the tree that's too big to build in memory around 
+// its first item, like __VPT_build_frame() does, writing the two halves to new 
+// files for the frames in next. It takes two passes over the file. The first 
+// writes the distances to the vantage point to another file, and samples as 
+// many of them as fit in the memory budget to estimate the median. The second 
+// sorts the items onto either side of the median.
+static inline bool
+__VPT_split_spill(VPTree* vpt, VPSpillFrame popped, size_t memory_budget, VPSpillFrame* next) {
+    size_t i, num_entries = popped.num_items - 1;
+    VPEntry vantage_point, entry;
+    dist_t dist, min_dist = (dist_t) DIST_MAX;
+
+    VPNode* newnode = __alloc_VPNode(&(vpt->allocator));
+    size_t sample_capacity = max(min(num_entries, memory_budget / sizeof(VPBuildKey)), 1);
+    size_t sample_stride = (num_entries + sample_capacity - 1) / sample_capacity, sample_size = 0;
+    VPBuildKey* sample = (VPBuildKey*) malloc(sample_capacity * sizeof(VPBuildKey));
+    FILE* distances = tmpfile();
+    next[0].file = tmpfile();
+    next[1].file = tmpfile();
+    bool success = newnode && sample && distances && next[0].file && next[1].file
+                && !fseek(popped.file, 0, SEEK_SET)
+                && fread(&vantage_point, sizeof(VPEntry), 1, popped.file) == 1;
+
+    // Calculate the distance from the vantage point to each entry.
+    for (i = 0; success && i < num_entries; i++) {
+        success = fread(&entry, sizeof(VPEntry), 1, popped.file) == 1;
+        if (!success) break;
+        dist = vpt->dist_fn(vpt->extra_data, vantage_point.item, entry.item);
+        success = fwrite(&dist, sizeof(dist_t), 1, distances) == 1;
+        if (dist < min_dist) min_dist = dist;
+        if (!(i % sample_stride)) sample[sample_size++].distance = dist;
+    }
+
+    // Split by the same rule as __VPT_split(), so that left <= radius < right.
+    // Entries the same distance as the median go right, unless nothing is closer.
+    dist_t median_dist = 0, radius = min_dist;
+    dist_t right_min = (dist_t) DIST_MAX, right_max = 0;
+    bool ties_left = false;
+    if (success) {
+        VPSelect(sample, sample_size, sample_size / 2);
+        median_dist = sample[sample_size / 2].distance;
+        ties_left = !(min_dist < median_dist);
+        if (ties_left) radius = median_dist;
+        success = !fseek(popped.file, sizeof(VPEntry), SEEK_SET) && !fseek(distances, 0, SEEK_SET);
+    }
+    next[0].num_items = next[1].num_items = 0;
+    for (i = 0; success && i < num_entries; i++) {
+        success = fread(&entry, sizeof(VPEntry), 1, popped.file) == 1
+               && fread(&dist, sizeof(dist_t), 1, distances) == 1;
+        if (!success) break;
+        bool right = ties_left ? dist > median_dist : dist >= median_dist;
+        if (!right && dist > radius) radius = dist;
+        if (right && dist < right_min) right_min = dist;
+        if (right && dist > right_max) right_max = dist;
+        entry.distance = dist;
+        success = fwrite(&entry, sizeof(VPEntry), 1, next[right].file) == 1;
+        next[right].num_items++;
+    }
+
+    if (distances) fclose(distances);
+    free(sample);
+    if (!success) {
+        if (next[0].file) fclose(next[0].file);
+        if (next[1].file) fclose(next[1].file);
+        return false;
+    }
+
+    newnode->ulabel = 'b';
+    newnode->u.branch.item = vantage_point.item;
+    newnode->u.branch.radius = radius;
+    newnode->u.branch.left_min = min_dist;
+    newnode->u.branch.right_min = right_min;
+    newnode->u.branch.right_max = right_max;
+    *popped.dest = newnode;
+
+    next[0].dest = &(newnode->u.branch.left);
+    next[0].depth = popped.depth + 1;
+    next[1].dest = &(newnode->u.branch.right);
+    next[1].depth = popped.depth + 1;
+    LOG("Split %lu spilled items.\n", popped.num_items);
+    return true;
+}
+
+/****************/
+/* Tree Methods */
+/****************/
+
+/**
+ * @return The options VPT_build() uses. Start from these when 
+ *         building a tree with VPT_build_config().
+ */
+static inline VPTConfig
+VPT_default_config(void) {
+    VPTConfig config;
+    config.build_threads = 1;
+    config.median_selection = true;
+    config.sort_threads = 0;
+    config.vp_strategy = VPT_VP_FIRST;
+    config.vp_sample_size = 16;
+    config.vp_seed = 0;
+    config.sort_threshold = SORT_THRESHOLD;
+    config.leaf_size = VPT_BUILD_LIST_THRESHOLD;
+    config.small_tree_size = VPT_MAX_LIST_SIZE;
+    config.leaf_distances = false;
+    config.best_first = false;
+    config.mvp_fanout = 0;
+    return config;
+}
+
+/**
+ * Constructs a Vantage Point Tree out of the given data, the same 
+ * way as VPT_build(), but with the given options.
+ * 
+ * With config->build_threads other than 1, once the root is split, the 
+ * subtrees are handed out to a pool of threads which steal work from 
+ * each other, so the build scales with the number of cores.
+ * 
+ * @param vpt The Vantage Point Tree to build.
+ * @param data A pointer to the data to construct the tree out of. 
+ * @param num_items The size of the data array.                
+ * @param dist_fn A metric on the metric space of values of vpt_t.
+ *                When building with more than one thread, it must be safe 
+ *                to call from multiple threads at once.
+ * @param extra_data Additional information to be passed to the dist_fn callback.
+ * @param config The options to build with, or NULL for the defaults.
+ * @return true if building the tree was successful, false if out of memory, 
+ *             or if there are too many items to index with vpt_idx_t.
+ *             No guaruntees on the state of the tree on failure, except 
+ *             that VPT_destroy() frees whatever was built.
+ */
+static inline bool
+VPT_build_config(VPTree* vpt, vpt_t* data, size_t num_items,
+                 dist_t (*dist_fn)(void* extra_data, vpt_t first, vpt_t second), void* extra_data,
+                 const VPTConfig* config) {
+    vpt->size = num_items;
+    vpt->height = 0;
+    vpt->dist_fn = dist_fn;
+    vpt->extra_data = extra_data;
+    vpt->config = config ? *config : VPT_default_config();
+    vpt->cache = NULL;
+    __VPT_STATS_RESET(vpt);
+
+    /* Init allocator */
+    if (!__VPT_init_allocator(&(vpt->allocator))) return false;
+
+    // A branch needs a vantage point and something on either side of it.
+    if (vpt->config.leaf_size < 3) vpt->config.leaf_size = 3;
+    if (vpt->config.mvp_fanout < 2) vpt->config.mvp_fanout = 0;
+    if (vpt->config.mvp_fanout > VPT_MAX_MVP_FANOUT) vpt->config.mvp_fanout = VPT_MAX_MVP_FANOUT;
+
+    if (num_items < vpt->config.small_tree_size) {
+        LOG("Building small tree of size %lu.\n", num_items)
+        return __VPT_small_build(vpt, data, num_items);
+    }
+    LOG("Building large tree of size %lu.\n", num_items)
+
+    /* Items can be large, so instead of moving them around, sort and resort 
+       keys that refer to them as the tree is built. Each item is copied once, 
+       into the node or list it ends up in. The first item will become the root. */
+    if (num_items - 1 > (size_t)(vpt_idx_t)-1) return false;
+    VPBuildKey* keys = (VPBuildKey*) malloc(num_items * sizeof(VPBuildKey));
+    if (!keys) return false;
+    for (size_t i = 0; i < num_items; i++) {
+        keys[i].index = (vpt_idx_t)i;
+    }
+    LOGs("Key list initialized.");
+
+    bool success = __VPT_build_keys(vpt, data, keys, num_items, &(vpt->root), 1);
+    free(keys);
+    return success;
+}
+
+/**
+ * Constructs a Vantage Point Tree out of the given data.
+ * Destroy this tree using VPT_destroy or VPT_teardown.
+ * 
+ * This tree can store data of any type vpt_t for which the 
+ * set of possible items forms a metric space with distance 
+ * function dist_fn. You should #define vpt_t to be the type 
+ * that the tree should store before you #include "vpt.h".
+ * If you don't, the default is void*.
+ *
+ * Do not build a VPTree of size zero. The tree does not take 
+ * ownership of the data, it stores copies.
+ * 
+ * @param vpt The Vantage Point Tree to build.
+ * @param data A pointer to the data to construct the tree out of. 
+ * @param num_items The size of the data array.                
+ * @param dist_fn A metric on the metric space of values of vpt_t.
+ * @param extra_data Additional information to be passed to the dist_fn callback.
+ * @return true if building the tree was successful, false if out of memory.
+ *             No guaruntees on the state of the tree on failure.
+ */
+static inline bool
+VPT_build(VPTree* vpt, vpt_t* data, size_t num_items,
+          dist_t (*dist_fn)(void* extra_data, vpt_t first, vpt_t second), void* extra_data) {
+    return VPT_build_config(vpt, data, num_items, dist_fn, extra_data, NULL);
+}
+
+/**
+ * Constructs a Vantage Point Tree out of items read one at a time from a 
+ * stream, for data that doesn't fit in memory along with the extra space 
+ * VPT_build() needs to build a tree out of it.
+ * 
+ * If the whole stream fits in memory_budget, the tree is built the same way as 
+ * VPT_build_config(). If it doesn't, the items are spilled to a temporary file. 
+ * While a part of the tree is too big to build within the budget, it's split 
+ * around its first item in two passes over its file, and its halves are 
+ * spilled to files of their own. Each part that fits is read back and built 
+ * in memory. The median each split is made around is estimated from as many 
+ * of the distances as fit in the budget.
+ * 
+ * The result is a normal in-memory tree. The budget only limits the memory 
+ * used to build it, not the memory taken by the tree itself.
+ * 
+ * Items are written to the temporary files byte for byte, so if vpt_t is or 
+ * contains a pointer, what it points to must outlive the build.
+ * 
+ * @param vpt The Vantage Point Tree to build.
+ * @param next_item Writes the next item of the stream to item and returns 
+ *                  true, or returns false if the stream is finished.
+ * @param stream Passed to next_item.
+ * @param dist_fn A metric on the metric space of values of vpt_t.
+ * @param extra_data Additional information to be passed to the dist_fn callback.
+ * @param memory_budget How many bytes to build parts of the tree in memory with.
+ * @param config The options to build with, or NULL for the defaults.
+ * @return true if building the tree was successful, false if out of memory, 
+ *             or if a temporary file couldn't be created, written, or read.
+ *             No guaruntees on the state of the tree on failure.
+ */
+static inline bool
+VPT_build_stream(VPTree* vpt, bool (*next_item)(void* stream, vpt_t* item), void* stream,
+                 dist_t (*dist_fn)(void* extra_data, vpt_t first, vpt_t second), void* extra_data,
+                 size_t memory_budget, const VPTConfig* config) {
+    vpt->size = 0;
+    vpt->height = 0;
+    vpt->dist_fn = dist_fn;
+    vpt->extra_data = extra_data;
+    vpt->config = config ? *config : VPT_default_config();
+    vpt->cache = NULL;
+    __VPT_STATS_RESET(vpt);
+
+    /* Init allocator */
+    if (!__VPT_init_allocator(&(vpt->allocator))) return false;
+
+    // A branch needs a vantage point and something on either side of it.
+    if (vpt->config.leaf_size < 3) vpt->config.leaf_size = 3;
+    if (vpt->config.mvp_fanout < 2) vpt->config.mvp_fanout = 0;
+    if (vpt->config.mvp_fanout > VPT_MAX_MVP_FANOUT) vpt->config.mvp_fanout = VPT_MAX_MVP_FANOUT;
+
+    // Read as much of the stream as fits in the budget.
+    size_t max_in_memory = min(memory_budget / __VPT_build_bytes_per_item(vpt), (size_t)(vpt_idx_t)-1);
+    size_t capacity = 0;
+    vpt_t* items = NULL;
+    vpt_t item;
+    bool more;
+    while ((more = next_item(stream, &item)) && vpt->size < max_in_memory) {
+        if (vpt->size == capacity) {
+            size_t new_capacity = min(capacity ? 2 * capacity : VPT_STREAM_READ_SIZE, max_in_memory);
+            vpt_t* new_items = (vpt_t*) realloc(items, new_capacity * sizeof(vpt_t));
+            if (!new_items) {
+                free(items);
+                return false;
+            }
+            items = new_items;
+            capacity = new_capacity;
+        }
+        items[vpt->size++] = item;
+    }
+
+    // If that's all of it, build the tree in memory.
+    if (!more) {
+        LOG("Building streamed tree of size %lu in memory.\n", vpt->size)
+        bool success;
+        if (vpt->size < vpt->config.small_tree_size) {
+            success = __VPT_small_build(vpt, items, vpt->size);
+        } else {
+            VPBuildKey* keys = (VPBuildKey*) malloc(vpt->size * sizeof(VPBuildKey));
+            success = keys != NULL;
+            for (size_t i = 0; success && i < vpt->size; i++) keys[i].index = (vpt_idx_t)i;
+            if (success) success = __VPT_build_keys(vpt, items, keys, vpt->size, &(vpt->root), 1);
+            free(keys);
+        }
+        free(items);
+        return success;
+    }
+
+    // Otherwise, spill the items read so far and the rest of the stream to a file.
+    VPSpillFrame root_frame;
+    root_frame.file = tmpfile();
+    root_frame.dest = &(vpt->root);
+    root_frame.depth = 1;
+    bool success = root_frame.file != NULL;
+    VPEntry entry;
+    entry.distance = 0;
+    for (size_t i = 0; success && i < vpt->size; i++) {
+        entry.item = items[i];
+        success = fwrite(&entry, sizeof(VPEntry), 1, root_frame.file) == 1;
+    }
+    free(items);
+    while (success && more) {
+        entry.item = item;
+        success = fwrite(&entry, sizeof(VPEntry), 1, root_frame.file) == 1;
+        vpt->size++;
+        more = next_item(stream, &item);
+    }
+    root_frame.num_items = vpt->size;
+    LOG("Spilled %lu streamed items.\n", vpt->size)
+
+    // Split the spilled parts of the tree until they fit, left subtrees first.
+    size_t stacksize = 0, stack_capacity = VPT_MAX_HEIGHT;
+    VPSpillFrame* stack = (VPSpillFrame*) malloc(stack_capacity * sizeof(VPSpillFrame));
+    VPSpillFrame next[2];
+    if (root_frame.file) {
+        if (stack) stack[stacksize++] = root_frame;
+        else fclose(root_frame.file);
+    }
+    success = success && stack;
+
+    while (success && stacksize) {
+        VPSpillFrame popped = stack[--stacksize];
+        if (popped.depth > vpt->height) vpt->height = popped.depth;
+        if (__VPT_spill_fits(vpt, popped.num_items, memory_budget)) {
+            success = __VPT_build_spill_in_memory(vpt, popped);
+        } else {
+            success = __VPT_split_spill(vpt, popped, memory_budget, next);
+            if (success && stacksize + 2 > stack_capacity) {
+                VPSpillFrame* new_stack = (VPSpillFrame*) realloc(stack, 2 * stack_capacity * sizeof(VPSpillFrame));
+                if (new_stack) {
+                    stack = new_stack;
+                    stack_capacity *= 2;
+                } else {
+                    fclose(next[0].file);
+                    fclose(next[1].file);
+                    success = false;
+                }
+            }
+            if (success) {
+                stack[stacksize++] = next[1];
+                stack[stacksize++] = next[0];
+            }
+        }
+        fclose(popped.file);
+    }
+
+    while (stacksize) fclose(stack[--stacksize].file);
+    free(stack);
+    return success;
+}
+
+/**
+ * @return The size of this VPTree (The number of datapoints stored within this VPTree).
+ */
+static inline size_t
+VPT_size(VPTree* vpt) {
+    return vpt->size;
+}
+
+// Unlinks an entry from the list of entries by age.
+static inline void
+__VPT_cache_unlink(VPCache* cache, size_t e) {
+    VPCacheEntry* entry = cache->entries + e;
+    if (entry->newer != __VPT_CACHE_NONE) cache->entries[entry->newer].older = entry->older;
+    else cache->newest = entry->older;
+    if (entry->older != __VPT_CACHE_NONE) cache->entries[entry->older].newer = entry->newer;
+    else cache->oldest = entry->newer;
+}
+
+// Links an entry in as the newest.
+static inline void
+__VPT_cache_link_newest(VPCache* cache, size_t e) {
+    VPCacheEntry* entry = cache->entries + e;
+    entry->newer = __VPT_CACHE_NONE;
+    entry->older = cache->newest;
+    if (cache->newest != __VPT_CACHE_NONE) cache->entries[cache->newest].newer = e;
+    else cache->oldest = e;
+    cache->newest = e;
+}
+
+// Finds the entry for a query in the cache, or returns __VPT_CACHE_NONE. Two 
+// queries are the same if their bytes are. Calling the distance function 
+// instead would count against VPT_STATS and VPT_knn_cost(), for a search that 
+// never happens. The cache must be locked.
+static inline size_t
+__VPT_cache_find(VPTree* vpt, uint64_t hash, vpt_t query, size_t k, dist_t max_dist) {
+    VPCache* cache = vpt->cache;
+    size_t e = cache->buckets[hash % cache->capacity];
+    while (e != __VPT_CACHE_NONE) {
+        VPCacheEntry* entry = cache->entries + e;
+        if (entry->hash == hash && entry->k == k && entry->max_dist == max_dist &&
+            !memcmp(&(entry->query), &query, sizeof(vpt_t)))
+            return e;
+        e = entry->chain;
+    }
+    return __VPT_CACHE_NONE;
+}
+
+// Copies the cached results of a query to *results, and returns true, or 
+// returns false if they aren't cached. k is 0 for VPT_all_within() queries, 
+// and max_dist is 0 for knn queries. If *results is NULL, it's set to a 
+// buffer on the heap for the caller to free. Counts a hit or a miss.
+static inline bool
+__VPT_cache_get(VPTree* vpt, vpt_t query, size_t k, dist_t max_dist, VPEntry** results, size_t* num_results) {
+    VPCache* cache = vpt->cache;
+    uint64_t hash = cache->hash_fn(vpt->extra_data, query);
+    pthread_mutex_lock(&(cache->lock));
+    size_t e = __VPT_cache_find(vpt, hash, query, k, max_dist);
+    if (e != __VPT_CACHE_NONE && !*results) {
+        // Allocating one more than needed never asks malloc() for nothing.
+        *results = (VPEntry*) malloc((cache->entries[e].num_results + 1) * sizeof(VPEntry));
+        if (!*results) e = __VPT_CACHE_NONE;
+    }
+    if (e == __VPT_CACHE_NONE) {
+        cache->misses++;
+        pthread_mutex_unlock(&(cache->lock));
+        return false;
+    }
+
+    VPCacheEntry* entry = cache->entries + e;
+    for (size_t i = 0; i < entry->num_results; i++) (*results)[i] = entry->results[i];
+    *num_results = entry->num_results;
+    __VPT_cache_unlink(cache, e);
+    __VPT_cache_link_newest(cache, e);
+    cache->hits++;
+    pthread_mutex_unlock(&(cache->lock));
+    return true;
+}
+
+// Caches the results of a query, replacing the least recently used entry if 
+// the cache is full. If there's no memory for them, they just aren't cached.
+static inline void
+__VPT_cache_put(VPTree* vpt, vpt_t query, size_t k, dist_t max_dist, VPEntry* results, size_t num_results) {
+    VPCache* cache = vpt->cache;
+    uint64_t hash = cache->hash_fn(vpt->extra_data, query);
+    pthread_mutex_lock(&(cache->lock));
+
+    // Another thread may have just cached the same query.
+    if (__VPT_cache_find(vpt, hash, query, k, max_dist) != __VPT_CACHE_NONE) {
+        pthread_mutex_unlock(&(cache->lock));
+        return;
+    }
+
+    bool full = cache->num_entries == cache->capacity;
+    size_t e = full ? cache->oldest : cache->num_entries;
+    VPCacheEntry* entry = cache->entries + e;
+    if (num_results > entry->capacity) {
+        VPEntry* new_results = (VPEntry*) malloc(num_results * sizeof(VPEntry));
+        if (!new_results) {
+            pthread_mutex_unlock(&(cache->lock));
+            return;
+        }
+        free(entry->results);
+        entry->results = new_results;
+        entry->capacity = num_results;
+    }
+
+    // Evict the oldest entry, taking it out of its bucket's chain.
+    if (full) {
+        __VPT_cache_unlink(cache, e);
+        size_t* link = cache->buckets + entry->hash % cache->capacity;
+        while (*link != e) link = &(cache->entries[*link].chain);
+        *link = entry->chain;
+    } else {
+        cache->num_entries++;
+    }
+
+    entry->query = query;
+    entry->hash = hash;
+    entry->k = k;
+    entry->max_dist = max_dist;
+    for (size_t i = 0; i < num_results; i++) entry->results[i] = results[i];
+    entry->num_results = num_results;
+    entry->chain = cache->buckets[hash % cache->capacity];
+    cache->buckets[hash % cache->capacity] = e;
+    __VPT_cache_link_newest(cache, e);
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+// Frees a cache, if there is one.
+static inline void
+__VPT_cache_free(VPCache* cache) {
+    if (!cache) return;
+    for (size_t i = 0; i < cache->capacity; i++) free(cache->entries[i].results);
+    pthread_mutex_destroy(&(cache->lock));
+    free(cache->buckets);
+    free(cache->entries);
+    free(cache);
+}
+
+/**
+ * Forgets every result in the tree's cache. VPT_rebuild() and 
+ * VPT_add_rebuild() do this themselves. Call it after changing anything 
+ * else that would change the results of queries, like the tree's extra_data. 
+ * Does nothing if the tree has no cache.
+ * 
+ * @param vpt The tree whose cache to clear.
+ */
+static inline void
+VPT_cache_clear(VPTree* vpt) {
+    VPCache* cache = vpt->cache;
+    if (!cache) return;
+    pthread_mutex_lock(&(cache->lock));
+    for (size_t i = 0; i < cache->capacity; i++) cache->buckets[i] = __VPT_CACHE_NONE;
+    cache->num_entries = 0;
+    cache->newest = cache->oldest = __VPT_CACHE_NONE;
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/**
+ * Gives the tree a cache of the results of its most recently used queries. 
+ * When the same query is made again with VPT_knn(), VPT_nn(), or 
+ * VPT_all_within(), with the same k or max_dist, the results are copied from 
+ * the cache instead of searching the tree. Worth it when a few queries make 
+ * up much of the traffic. Other kinds of queries don't use the cache.
+ * 
+ * Queries are looked up by hash_fn, and then compared byte for byte, so a 
+ * hit calculates no distances. If vpt_t is a struct, its padding must be 
+ * zeroed, or equal queries may miss. Each entry holds one query's results, 
+ * so VPT_all_within() queries with many matches take that much more memory. 
+ * Queries are kept by value, like the items of the tree, so if vpt_t is a 
+ * pointer, what a query points to must stay valid until it leaves the cache.
+ * 
+ * The cache is safe to query from many threads at once, but they take turns 
+ * looking up and storing results. Rebuilding the tree clears it, and 
+ * VPT_destroy() frees it. Hits are not counted by VPT_STATS.
+ * 
+ * @param vpt The tree to give a cache.
+ * @param capacity The most queries to keep the results of. 0 removes the 
+ *                 tree's cache, if it has one.
+ * @param hash_fn Hashes a query. Called with the tree's extra_data.
+ * @return true on success, false if out of memory, in which case the tree 
+ *         has no cache.
+ */
+static inline bool
+VPT_cache_init(VPTree* vpt, size_t capacity, uint64_t (*hash_fn)(void* extra_data, vpt_t item)) {
+    __VPT_cache_free(vpt->cache);
+    vpt->cache = NULL;
+    if (!capacity) return true;
+
+    VPCache* cache = (VPCache*) malloc(sizeof(VPCache));
+    VPCacheEntry* entries = (VPCacheEntry*) malloc(capacity * sizeof(VPCacheEntry));
+    size_t* buckets = (size_t*) malloc(capacity * sizeof(size_t));
+    if (!cache || !entries || !buckets || pthread_mutex_init(&(cache->lock), NULL)) {
+        free(cache);
+        free(entries);
+        free(buckets);
+        return false;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        entries[i].results = NULL;
+        entries[i].capacity = 0;
+    }
+    cache->hash_fn = hash_fn;
+    cache->entries = entries;
+    cache->buckets = buckets;
+    cache->capacity = capacity;
+    cache->hits = cache->misses = 0;
+    vpt->cache = cache;
+    VPT_cache_clear(vpt);
+    return true;
+}
+
+/**
+ * Gets how many queries were answered from the tree's cache, and how many 
+ * had to search the tree, since VPT_cache_init(). Both are 0 if the tree has 
+ * no cache.
+ * 
+ * @param vpt The tree whose cache to check.
+ * @param hits Set to the number of queries answered by the cache.
+ * @param misses Set to the number of queries that weren't.
+ */
+static inline void
+VPT_cache_stats(VPTree* vpt, size_t* hits, size_t* misses) {
+    VPCache* cache = vpt->cache;
+    *hits = *misses = 0;
+    if (!cache) return;
+    pthread_mutex_lock(&(cache->lock));
+    *hits = cache->hits;
+    *misses = cache->misses;
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/**
+ * Frees the resources owned by this VPTree. 
+ *
+ * The VPTree is not usable after this function is called. However, you can reuse 
+ * the struct to build a new one via VPT_build. 
+ * 
+ * @param vpt The Vantage Point Tree to destroy.
+ */
+static inline void
+VPT_destroy(VPTree* vpt) {
+    NodeAllocs* node_allocs = vpt->allocator.node_allocs;
+    while (node_allocs) {
+        NodeAllocs* consumed_node_allocs = node_allocs;
+        node_allocs = node_allocs->next;
+        free(consumed_node_allocs);
+    }
+
+    ListAllocs* list_allocs = vpt->allocator.list_allocs;
+    while (list_allocs) {
+        ListAllocs* consumed_list_allocs = list_allocs;
+        list_allocs = list_allocs->next;
+        free(consumed_list_allocs);
+    }
+
+    DistAllocs* dist_allocs = vpt->allocator.dist_allocs;
+    while (dist_allocs) {
+        DistAllocs* consumed_dist_allocs = dist_allocs;
+        dist_allocs = dist_allocs->next;
+        free(consumed_dist_allocs);
+    }
+
+    ChildAllocs* child_allocs = vpt->allocator.child_allocs;
+    while (child_allocs) {
+        ChildAllocs* consumed_child_allocs = child_allocs;
+        child_allocs = child_allocs->next;
+        free(consumed_child_allocs);
+    }
+
+    __VPT_cache_free(vpt->cache);
+    vpt->cache = NULL;
+    LOGs("Tree destruction complete.");
+}
+
+/**
+ * Frees the resources owned by this VPTree, and returns 
+ * a buffer containing all the items that were inside. 
+ * The size of the buffer returned is the same as vpt->size.
+ * 
+ * The VPTree is not usable after this function is called. However, you can reuse 
+ * the struct to build a new one via VPT_build. Until you do so, you can also access
+ * the previous size of the tree through vpt->size.
+ * 
+ * The buffer of items returned by this function is allocated with malloc() 
+ * and must be freed. 
+ * 
+ * @param vpt The Vantage Point Tree to destroy.
+ * @return The items that were contained in the tree, or NULL if out of memory.
+ *             If this method returns null (there's not enough memory to 
+ *             allocate the buffer to return), the tree will not be destroyed 
+ *             and will remain usable.
+ */
+static inline vpt_t*
 VPT_teardown(VPTree* vpt) {
     size_t all_size = 0;
     vpt_t* all_items = (vpt_t*) malloc(sizeof(vpt_t) * vpt->size);
@@ -578,378 +2436,2347 @@ VPT_teardown(VPTree* vpt) {
         return NULL;
     }
 
-    NodeAllocs* node_allocs = vpt->allocator.node_allocs;
-    while (node_allocs) {
-        for (size_t i = 0; i < node_allocs->size; i++) {
-            VPNode node = node_allocs->buffer[i];
-            if (node.ulabel == 'b') {
-                vpt_t item = node.u.branch.item;
-                all_items[all_size++] = item;
+    NodeAllocs* node_allocs = vpt->allocator.node_allocs;
+    while (node_allocs) {
+        for (size_t i = 0; i < node_allocs->size; i++) {
+            VPNode node = node_allocs->buffer[i];
+            if (node.ulabel == 'b') {
+                vpt_t item = node.u.branch.item;
+                all_items[all_size++] = item;
+            } else if (node.ulabel == 'm') {
+                all_items[all_size++] = node.u.multi.items[0];
+                all_items[all_size++] = node.u.multi.items[1];
+            } else {
+                size_t listsize = node.u.pointlist.size;
+                for (size_t j = 0; j < listsize; j++) {
+                    vpt_t item = node.u.pointlist.items[j];
+                    all_items[all_size++] = item;
+                }
+            }
+        }
+        NodeAllocs* consumed_alloc_list = node_allocs;
+        node_allocs = node_allocs->next;
+        free(consumed_alloc_list);
+    }
+
+    ListAllocs* list_allocs = vpt->allocator.list_allocs;
+    while (list_allocs) {
+        ListAllocs* consumed_list_allocs = list_allocs;
+        list_allocs = list_allocs->next;
+        free(consumed_list_allocs);
+    }
+
+    DistAllocs* dist_allocs = vpt->allocator.dist_allocs;
+    while (dist_allocs) {
+        DistAllocs* consumed_dist_allocs = dist_allocs;
+        dist_allocs = dist_allocs->next;
+        free(consumed_dist_allocs);
+    }
+
+    ChildAllocs* child_allocs = vpt->allocator.child_allocs;
+    while (child_allocs) {
+        ChildAllocs* consumed_child_allocs = child_allocs;
+        child_allocs = child_allocs->next;
+        free(consumed_child_allocs);
+    }
+
+    __VPT_cache_free(vpt->cache);
+    vpt->cache = NULL;
+
+    // Assert all_size == vpt->size
+    LOGs("Tree disassembly complete.");
+    return all_items;
+}
+
+/**
+ * Rebuilds this Vantage Point Tree using the points already inside of it.
+ * 
+ * As you add points to the tree using VPT_add, the tree may become unbalanced.
+ * At some point for efficiency of querying the tree, it becomes worth it to 
+ * rebuild the tree to balance it.
+ * 
+ * @param vpt The Vantage Point Tree to rebuild.
+ * @return true on success, false if out of memory.
+ *             No guaruntees on the state of the tree on failure.
+ */
+static inline bool 
+VPT_rebuild(VPTree* vpt) {
+    // Keep the cache, but not the results of queries on the old tree.
+    VPCache* cache = vpt->cache;
+    vpt->cache = NULL;
+    vpt_t* items = VPT_teardown(vpt);
+    if (!items) {
+        __VPT_cache_free(cache);
+        return false;
+    }
+
+    bool success = VPT_build_config(vpt, items, vpt->size, vpt->dist_fn, vpt->extra_data, &(vpt->config));
+    vpt->cache = cache;
+    VPT_cache_clear(vpt);
+    if (!success) return false;
+
+    free(items);
+    return true;
+}
+
+// The search VPT_knn() does, adding to a list that may already hold some 
+// candidates, in space passed in so that batches of queries can reuse it. 
+// to_traverse needs room for __VPT_traversal_stack_size(vpt) nodes. The tree 
+// must not be empty. VPT_knn_graph() passes the leaf whose items are already 
+// in the list as skip_leaf, or the slot of the item being searched for as 
+// skip_item, so that the item doesn't find itself. Both may be NULL.
+// Only items that filter returns true for are added to the list, unless 
+// filter is NULL. Leaf items are filtered before their distance is calculated.
+static inline void
+__VPT_knn_search(VPTree* vpt, vpt_t datapoint, VPKnnList* list, NodeDistTuple* to_traverse,
+                 VPNode* skip_leaf, vpt_t* skip_item, VPPredicate filter, void* filter_data) {
+    __VPT_STATS_BEGIN;
+    VPKnnList knnlist = *list;
+
+    // The largest distance to a knn, once there are k of them
+    dist_t tau = knnlist.tau;
+
+    // Now it's time to traverse the tree for the k-nearest datapoints we're looking for.
+
+    // Prepare for warcrimes beyond this point. There are definitely a 
+    // lot of things here that could be split into multiple functions for 
+    // readability. "No premature optimizations," right? Well, I measured.
+    // It's definitely less readable this way, but it's a lot faster (~2x) not to 
+    // call a function for each jump in traversal. Instead of doing it recursively
+    // with the call stack, we use a loop and a normal stack.
+
+    // Initialize a stack of nodes in the tree we still have to check
+    size_t to_traverse_size = 1;
+    VPNode* current_node;
+    // push the root onto the stack of nodes to check
+    to_traverse[0].node = vpt->root;
+    to_traverse[0].dist = 0;
+
+    // When we need to check a part of the tree, we push the root node of that subtree onto the stack. 
+    // That way, processing the stack until there are no more items left is equivalent to checking every
+    // necessary part of the tree.
+    while (to_traverse_size) {
+        // Pop a node from the stack
+        NodeDistTuple popped = to_traverse[--to_traverse_size];
+        current_node = popped.node;
+
+        // If the node is a branch, 
+        if (current_node->ulabel == 'b') {
+            // Calculate the distance between this branch node and the target point.
+            dist_t dist = vpt->dist_fn(vpt->extra_data, current_node->u.branch.item, datapoint);
+            __VPT_STAT(dist_calls, 1);
+            __VPT_STAT(branches_visited, 1);
+            __VPT_STAT(subtrees_pruned, 2);
+            
+            // Push the node we're visiting onto the list of candidates and
+            // update tau when changes are made to the list.
+            if (dist < tau && &(current_node->u.branch.item) != skip_item &&
+                (!filter || filter(filter_data, current_node->u.branch.item)))
+                tau = __VPT_knnlist_add_found(&knnlist, current_node->u.branch.item, dist, current_node, 0);
+
+            // Keep track of the parts of the tree that could still have nearest neighbors, and push
+            // them onto the traversal stack. Keep doing this until we run out of tree to traverse.
+            // The side the query is on goes on top, so that it's searched first and shrinks tau.
+            // A side could only have something within tau if its shell does.
+            VPBranch* branch = &(current_node->u.branch);
+            bool search_left = dist - tau <= branch->radius && dist + tau >= branch->left_min;
+            bool search_right = dist + tau >= branch->right_min && dist - tau <= branch->right_max;
+            if (dist > branch->radius) {
+                if (search_left) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->left, dist};
+                if (search_right) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->right, dist};
+            } else {
+                if (search_right) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->right, dist};
+                if (search_left) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->left, dist};
+            }
+            __VPT_STAT_STACK(to_traverse_size);
+        }
+
+        // If it's a multi-vantage-point branch, do the same with both vantage 
+        // points, and push the children whose shells the query is in last.
+        else if (current_node->ulabel == 'm') {
+            VPMulti* multi = &(current_node->u.multi);
+            dist_t dists[2];
+            for (size_t v = 0; v < 2; v++) {
+                dists[v] = vpt->dist_fn(vpt->extra_data, multi->items[v], datapoint);
+                if (dists[v] < tau && multi->items + v != skip_item &&
+                    (!filter || filter(filter_data, multi->items[v])))
+                    tau = __VPT_knnlist_add_found(&knnlist, multi->items[v], dists[v], current_node, v);
+            }
+            __VPT_STAT(dist_calls, 2);
+            __VPT_STAT(branches_visited, 1);
+
+            size_t num_children = multi->fanout * multi->fanout;
+            __VPT_STAT(subtrees_pruned, num_children);
+            for (int contains_query = 0; contains_query < 2; contains_query++) {
+                for (size_t c = 0; c < num_children; c++) {
+                    dist_t bound = __VPT_multi_lower_bound(multi->children + c, dists[0], dists[1]);
+                    if (bound <= tau && (bound == 0) == contains_query)
+                        to_traverse[to_traverse_size++] = (NodeDistTuple){multi->children[c].node, dists[1]};
+                }
+            }
+            __VPT_STAT_STACK(to_traverse_size);
+        }
+
+        // If the node we popped is a list,
+        else if (current_node != skip_leaf) {
+            size_t vplist_size = current_node->u.pointlist.size;
+            vpt_t* vplist = current_node->u.pointlist.items;
+            dist_t* vpdists = current_node->u.pointlist.distances;
+
+            // Update the new k nearest neighbors
+            // 1. Break off the first k elements of the array (Already done)
+            // 2. Sort the first k elements (they happen to have already been constructed sorted)
+            // 3. Keep track of the largest distance to any of the k items. (This is tau, initialized 
+            //    earlier to infinity, or updated after any time __VPT_knnlist_add() is called.)
+            // 4. Iterate over the rest of the list. If the visited element is less than the
+            // largest element of the first k, swap it in and shift it into place so the list
+            // stays sorted. Then update the largest element. That's what we do below, 
+            // calculating each distance as we go, because leaves can be any size.
+            // If the leaf has the items' distances to its parent's vantage point, 
+            // skip the items that can't get under tau without calculating them.
+            __VPT_STAT(leaves_scanned, 1);
+            for (size_t i = 0; i < vplist_size; i++) {
+                if (vpdists && __VPT_dist_lower_bound(popped.dist, vpdists[i]) >= tau) continue;
+                if (vplist + i == skip_item) continue;
+                if (filter && !filter(filter_data, vplist[i])) continue;
+                dist_t dist = vpt->dist_fn(vpt->extra_data, vplist[i], datapoint);
+                __VPT_STAT(dist_calls, 1);
+                if (dist < tau) tau = __VPT_knnlist_add_found(&knnlist, vplist[i], dist, current_node, i);
+            }
+        }
+    }
+
+    *list = knnlist;
+    __VPT_STATS_END(vpt);
+}
+
+// The search VPT_knn() does. knnlist_buffer needs room for 
+// __VPT_KNNLIST_BUFFER_SIZE(k) entries. k must not be zero.
+static inline void
+__VPT_knn(VPTree* vpt, vpt_t datapoint, size_t k, VPEntry* knnlist_buffer, NodeDistTuple* to_traverse,
+          VPEntry* result_space, size_t* num_results) {
+    VPKnnList knnlist;
+    __VPT_knnlist_init(&knnlist, k, knnlist_buffer, result_space);
+    __VPT_knn_search(vpt, datapoint, &knnlist, to_traverse, NULL, NULL, NULL, NULL);
+
+    // Copy the results into the result space and return
+    __VPT_knnlist_finish(&knnlist, result_space, num_results);
+}
+
+static inline void
+__VPT_queue_init(VPQueue* queue, VPQueueEntry* buffer, size_t capacity) {
+    queue->entries = queue->buffer = buffer;
+    queue->size = 0;
+    queue->capacity = capacity;
+}
+
+static inline void
+__VPT_queue_free(VPQueue* queue) {
+    if (queue->entries != queue->buffer) free(queue->entries);
+}
+
+static inline bool
+__VPT_queue_push(VPQueue* queue, dist_t bound, VPNode* node, dist_t dist) {
+    if (queue->size == queue->capacity) {
+        VPQueueEntry* new_entries = (VPQueueEntry*)malloc(2 * queue->capacity * sizeof(VPQueueEntry));
+        if (!new_entries) return false;
+        for (size_t i = 0; i < queue->size; i++) new_entries[i] = queue->entries[i];
+        __VPT_queue_free(queue);
+        queue->entries = new_entries;
+        queue->capacity *= 2;
+    }
+
+    // Sift up
+    size_t i = queue->size++;
+    while (i && queue->entries[(i - 1) / 2].bound > bound) {
+        queue->entries[i] = queue->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->entries[i].bound = bound;
+    queue->entries[i].subtree.node = node;
+    queue->entries[i].subtree.dist = dist;
+    return true;
+}
+
+static inline VPQueueEntry
+__VPT_queue_pop(VPQueue* queue) {
+    VPQueueEntry top = queue->entries[0];
+    VPQueueEntry last = queue->entries[--queue->size];
+
+    // Sift the last entry down from the root
+    size_t i = 0, child;
+    while ((child = 2 * i + 1) < queue->size) {
+        if (child + 1 < queue->size && queue->entries[child + 1].bound < queue->entries[child].bound) child++;
+        if (!(queue->entries[child].bound < last.bound)) break;
+        queue->entries[i] = queue->entries[child];
+        i = child;
+    }
+    queue->entries[i] = last;
+    return top;
+}
+
+// The search VPT_knn() does when the tree is configured to search best first. 
+// Subtrees are searched in order of how close the query could be to them. 
+// Everything in each subtree of a branch is within the subtree's shell around 
+// the branch's item, so by the triangle inequality, the query is at least 
+// __VPT_shell_lower_bound() away from them. knnlist_buffer needs room for __VPT_KNNLIST_BUFFER_SIZE(k) 
+// entries. Returns false if out of memory.
+// 
+// For VPT_knn_approx(), subtrees and leaf items are pruned by tau / (1 + epsilon) 
+// instead of tau, and the search stops after max_leaves leaves, unless that's 0.
+// 
+// Items are filtered the same way as by __VPT_knn_search().
+static inline bool
+__VPT_knn_best_first(VPTree* vpt, vpt_t datapoint, size_t k, VPEntry* knnlist_buffer,
+                     VPEntry* result_space, size_t* num_results, double epsilon, size_t max_leaves,
+                     VPPredicate filter, void* filter_data) {
+    __VPT_STATS_BEGIN;
+    VPKnnList knnlist;
+    __VPT_knnlist_init(&knnlist, k, knnlist_buffer, result_space);
+    dist_t tau = (dist_t) DIST_MAX, prune_tau = tau;
+    size_t num_leaves = 0;
+    bool success = true;
+
+    VPQueueEntry queue_buffer[VPT_BEST_FIRST_QUEUE_SIZE];
+    VPQueue queue;
+    __VPT_queue_init(&queue, queue_buffer, VPT_BEST_FIRST_QUEUE_SIZE);
+    __VPT_queue_push(&queue, 0, vpt->root, 0);
+
+    while (success && queue.size) {
+        // Once the closest subtree left is too far, so is everything else.
+        VPQueueEntry popped = __VPT_queue_pop(&queue);
+        if (popped.bound >= prune_tau) break;
+        VPNode* current_node = popped.subtree.node;
+
+        if (current_node->ulabel == 'b') {
+            dist_t dist = vpt->dist_fn(vpt->extra_data, current_node->u.branch.item, datapoint);
+            __VPT_STAT(dist_calls, 1);
+            __VPT_STAT(branches_visited, 1);
+            __VPT_STAT(subtrees_pruned, 2);
+            if (dist < tau && (!filter || filter(filter_data, current_node->u.branch.item))) {
+                tau = __VPT_knnlist_add(&knnlist, current_node->u.branch.item, dist);
+                prune_tau = epsilon ? (dist_t)(tau / (1 + epsilon)) : tau;
+            }
+
+            // A subtree is at least as far as its parent was.
+            dist_t left_bound = __VPT_shell_lower_bound(dist, current_node->u.branch.left_min,
+                                                        current_node->u.branch.radius);
+            dist_t right_bound = __VPT_shell_lower_bound(dist, current_node->u.branch.right_min,
+                                                         current_node->u.branch.right_max);
+            if (left_bound < popped.bound) left_bound = popped.bound;
+            if (right_bound < popped.bound) right_bound = popped.bound;
+            if (left_bound < prune_tau)
+                success = __VPT_queue_push(&queue, left_bound, current_node->u.branch.left, dist);
+            if (success && right_bound < prune_tau)
+                success = __VPT_queue_push(&queue, right_bound, current_node->u.branch.right, dist);
+            __VPT_STAT_STACK(queue.size);
+        } else if (current_node->ulabel == 'm') {
+            VPMulti* multi = &(current_node->u.multi);
+            dist_t dists[2];
+            for (size_t v = 0; v < 2; v++) {
+                dists[v] = vpt->dist_fn(vpt->extra_data, multi->items[v], datapoint);
+                if (dists[v] < tau && (!filter || filter(filter_data, multi->items[v]))) {
+                    tau = __VPT_knnlist_add(&knnlist, multi->items[v], dists[v]);
+                    prune_tau = epsilon ? (dist_t)(tau / (1 + epsilon)) : tau;
+                }
+            }
+            __VPT_STAT(dist_calls, 2);
+            __VPT_STAT(branches_visited, 1);
+
+            size_t num_children = multi->fanout * multi->fanout;
+            __VPT_STAT(subtrees_pruned, num_children);
+            for (size_t c = 0; success && c < num_children; c++) {
+                dist_t bound = __VPT_multi_lower_bound(multi->children + c, dists[0], dists[1]);
+                if (bound < popped.bound) bound = popped.bound;
+                if (bound < prune_tau)
+                    success = __VPT_queue_push(&queue, bound, multi->children[c].node, dists[1]);
+            }
+            __VPT_STAT_STACK(queue.size);
+        } else {
+            size_t vplist_size = current_node->u.pointlist.size;
+            vpt_t* vplist = current_node->u.pointlist.items;
+            dist_t* vpdists = current_node->u.pointlist.distances;
+            __VPT_STAT(leaves_scanned, 1);
+            for (size_t i = 0; i < vplist_size; i++) {
+                if (vpdists && __VPT_dist_lower_bound(popped.subtree.dist, vpdists[i]) >= prune_tau) continue;
+                if (filter && !filter(filter_data, vplist[i])) continue;
+                dist_t dist = vpt->dist_fn(vpt->extra_data, vplist[i], datapoint);
+                __VPT_STAT(dist_calls, 1);
+                if (dist < tau) {
+                    tau = __VPT_knnlist_add(&knnlist, vplist[i], dist);
+                    prune_tau = epsilon ? (dist_t)(tau / (1 + epsilon)) : tau;
+                }
+            }
+            if (++num_leaves == max_leaves) break;
+        }
+    }
+
+    __VPT_queue_free(&queue);
+    __VPT_STATS_END(vpt);
+    __VPT_knnlist_finish(&knnlist, result_space, num_results);
+    if (!success) *num_results = 0;
+    return success;
+}
+
+/**
+ * Performs a k-nearest-neighbor search on the Vantage Point Tree, finding the 
+ * k closest datapoints in the tree to the datapoint provided, according to the 
+ * VPTree's distance function.
+ * 
+ * You are expected to provide the buffer result_space, which the results are 
+ * written to. It should be of size equal to or greater than the size of 
+ * "VPEntry result_space[k];", which is to say (k * sizeof(VPEntry)) bytes.
+ * 
+ * The number of results found is written to num_results. If the tree is 
+ * empty, then no results are written. If k is larger than the tree, every 
+ * item in the tree is written. The results are sorted nearest first.
+ * 
+ * For k of VPT_KNN_HEAP_THRESHOLD and up, the candidates are kept in a 
+ * max-heap in result_space itself, so large k take no extra stack space.
+ * 
+ * @param vpt The VPTree to search.
+ * @param datapoint The query point.
+ * @param k The number of nearest points to the query point to fetch.
+ * @param result_space
+ * @param num_results
+ * @return true on success, false if out of memory. Memory is only 
+ *         allocated for trees taller than VPT_MAX_HEIGHT, or when searching 
+ *         best first, once more than VPT_BEST_FIRST_QUEUE_SIZE subtrees 
+ *         are waiting to be searched.
+ */
+static inline bool
+VPT_knn(VPTree* vpt, vpt_t datapoint, size_t k, VPEntry* result_space, size_t* num_results) {
+    *num_results = 0;
+    if (!vpt->size || !k) return true;
+
+    if (vpt->cache && __VPT_cache_get(vpt, datapoint, k, 0, &result_space, num_results)) return true;
+
+    // Only small k need space besides the result space, so this is small.
+    VPEntry knnlist[__VPT_KNNLIST_BUFFER_SIZE(k)];
+    if (vpt->config.best_first) {
+        if (!__VPT_knn_best_first(vpt, datapoint, k, knnlist, result_space, num_results, 0, 0, NULL, NULL))
+            return false;
+    } else {
+        NodeDistTuple stack_buffer[VPT_MAX_HEIGHT];
+        NodeDistTuple* to_traverse = __VPT_traversal_stack(vpt, stack_buffer);
+        if (!to_traverse) return false;
+        __VPT_knn(vpt, datapoint, k, knnlist, to_traverse, result_space, num_results);
+        __VPT_free_traversal_stack(to_traverse, stack_buffer);
+    }
+
+    if (vpt->cache) __VPT_cache_put(vpt, datapoint, k, 0, result_space, *num_results);
+    return true;
+}
+
+/**
+ * Performs an approximate k-nearest-neighbor search on the Vantage Point Tree. 
+ * Trades some accuracy for speed, which is worth it in high dimensions, 
+ * where an exact search visits most of the tree.
+ * 
+ * The search is best first, like VPT_knn() with config.best_first. With an 
+ * epsilon other than 0, subtrees are skipped unless something in them could 
+ * be more than (1 + epsilon) times closer than the current k-th nearest 
+ * neighbor. Each result is then at most (1 + epsilon) times farther than the 
+ * true neighbor of the same rank. With a max_leaves other than 0, the search 
+ * also stops after searching that many leaves, with no guarantee.
+ * 
+ * The results are written the same way as VPT_knn() writes them. Use 
+ * tests/vpt_recall.c to measure the recall of different settings.
+ * 
+ * @param vpt The VPTree to search.
+ * @param datapoint The query point.
+ * @param k The number of nearest points to the query point to fetch.
+ * @param epsilon How much farther than the true neighbors results may be, 
+ *                or 0 for no limit on pruning.
+ * @param max_leaves The most leaves to search, or 0 for no limit.
+ * @param result_space Space for k VPEntries.
+ * @param num_results The number of results written.
+ * @return true on success, false if out of memory. Memory is only allocated 
+ *         once more than VPT_BEST_FIRST_QUEUE_SIZE subtrees are waiting to 
+ *         be searched.
+ */
+static inline bool
+VPT_knn_approx(VPTree* vpt, vpt_t datapoint, size_t k, double epsilon, size_t max_leaves,
+               VPEntry* result_space, size_t* num_results) {
+    *num_results = 0;
+    if (!vpt->size || !k) return true;
+
+    VPEntry knnlist[__VPT_KNNLIST_BUFFER_SIZE(k)];
+    return __VPT_knn_best_first(vpt, datapoint, k, knnlist, result_space, num_results, epsilon, max_leaves, NULL, NULL);
+}
+
+/**
+ * Performs a k-nearest-neighbor search on the Vantage Point Tree, like 
+ * VPT_knn(), but only for items that the predicate returns true for. 
+ * 
+ * The predicate is checked during the search, before an item can become a 
+ * candidate, so only items that pass it tighten the search radius. This finds 
+ * the k nearest matching items even when few items match, where filtering the 
+ * results of a larger VPT_knn() would have to guess how many to fetch. Leaf 
+ * items that don't match are skipped without calculating their distances, so 
+ * the predicate should be cheaper than the distance function. The vantage 
+ * points of branches are still measured, because the search needs their 
+ * distances to navigate.
+ * 
+ * The results are written the same way as VPT_knn() writes them. There are 
+ * fewer than k if fewer than k items match.
+ * 
+ * @param vpt The VPTree to search.
+ * @param datapoint The query point.
+ * @param k The number of nearest matching points to fetch.
+ * @param predicate Returns true for the items that may be results.
+ * @param user_data Passed to the predicate.
+ * @param result_space Space for k VPEntries.
+ * @param num_results The number of results written.
+ * @return true on success, false if out of memory, the same as VPT_knn().
+ */
+static inline bool
+VPT_knn_filtered(VPTree* vpt, vpt_t datapoint, size_t k, VPPredicate predicate, void* user_data,
+                 VPEntry* result_space, size_t* num_results) {
+    *num_results = 0;
+    if (!vpt->size || !k) return true;
+
+    VPEntry knnlist_buffer[__VPT_KNNLIST_BUFFER_SIZE(k)];
+    if (vpt->config.best_first)
+        return __VPT_knn_best_first(vpt, datapoint, k, knnlist_buffer, result_space, num_results, 0, 0,
+                                    predicate, user_data);
+
+    NodeDistTuple stack_buffer[VPT_MAX_HEIGHT];
+    NodeDistTuple* to_traverse = __VPT_traversal_stack(vpt, stack_buffer);
+    if (!to_traverse) return false;
+    VPKnnList knnlist;
+    __VPT_knnlist_init(&knnlist, k, knnlist_buffer, result_space);
+    __VPT_knn_search(vpt, datapoint, &knnlist, to_traverse, NULL, NULL, predicate, user_data);
+    __VPT_knnlist_finish(&knnlist, result_space, num_results);
+    __VPT_free_traversal_stack(to_traverse, stack_buffer);
+    return true;
+}
+
+/**
+ * Performs a k-nearest-neighbor search on the Vantage Point Tree, like 
+ * VPT_knn(), starting from the results of an earlier search for a nearby 
+ * query, such as the same object's position in the last frame.
+ * 
+ * The previous results are measured against the new query first. They're in 
+ * the tree, so the k-th nearest of them is at least as far as the new k-th 
+ * nearest neighbor, and the search can prune with that distance from the 
+ * root, rather than searching blind until it has found k candidates. The 
+ * closer the new query is to the old one, the more that saves. The search is 
+ * depth first, whatever config.best_first is.
+ * 
+ * The results are written the same way as VPT_knn() writes them. With fewer 
+ * than k previous results, this is the same as VPT_knn().
+ * 
+ * @param vpt The VPTree to search.
+ * @param datapoint The query point.
+ * @param k The number of nearest points to the query point to fetch.
+ * @param previous Different items of the tree, usually the results of a 
+ *                 search for a nearby query. Their distances are updated 
+ *                 to the new query. Must not overlap result_space.
+ * @param num_previous The number of previous results.
+ * @param result_space Space for k VPEntries.
+ * @param num_results The number of results written.
+ * @return true on success, false if out of memory, which can only happen 
+ *         for trees taller than VPT_MAX_HEIGHT.
+ */
+static inline bool
+VPT_knn_warm(VPTree* vpt, vpt_t datapoint, size_t k, VPEntry* previous, size_t num_previous,
+             VPEntry* result_space, size_t* num_results) {
+    *num_results = 0;
+    if (!vpt->size || !k) return true;
+
+    NodeDistTuple stack_buffer[VPT_MAX_HEIGHT];
+    NodeDistTuple* to_traverse = __VPT_traversal_stack(vpt, stack_buffer);
+    if (!to_traverse) return false;
+
+    // Find the k-th nearest of the previous results to the new query.
+    VPEntry knnlist_buffer[__VPT_KNNLIST_BUFFER_SIZE(k)];
+    VPKnnList knnlist;
+    __VPT_knnlist_init(&knnlist, k, knnlist_buffer, result_space);
+    dist_t tau = knnlist.tau;
+    for (size_t i = 0; i < num_previous; i++) {
+        previous[i].distance = vpt->dist_fn(vpt->extra_data, previous[i].item, datapoint);
+        if (previous[i].distance < tau) tau = __VPT_knnlist_add(&knnlist, previous[i].item, previous[i].distance);
+    }
+
+    // Search for anything closer than that, starting from an empty list so 
+    // that the previous results aren't found twice.
+    __VPT_knnlist_init(&knnlist, k, knnlist_buffer, result_space);
+    knnlist.tau = tau;
+    __VPT_knn_search(vpt, datapoint, &knnlist, to_traverse, NULL, NULL, NULL, NULL);
+    __VPT_knnlist_finish(&knnlist, result_space, num_results);
+    __VPT_free_traversal_stack(to_traverse, stack_buffer);
+
+    // If fewer than k are closer, the rest are exactly tau away, like the 
+    // k-th previous result, and there are enough of those to go around.
+    for (size_t i = 0; num_previous >= k && *num_results < k && i < num_previous; i++) {
+        if (previous[i].distance == tau) result_space[(*num_results)++] = previous[i];
+    }
+    return true;
+}
+
+// Pushes an item found by a VPTNeighborIterator onto its heap of them.
+static inline bool
+__VPT_neighbors_push(VPTNeighborIterator* iter, vpt_t item, dist_t distance) {
+    if (iter->num_items == iter->items_capacity) {
+        size_t new_capacity = 2 * iter->items_capacity;
+        VPEntry* new_items = (VPEntry*)realloc(iter->items, new_capacity * sizeof(VPEntry));
+        if (!new_items) return false;
+        iter->items = new_items;
+        iter->items_capacity = new_capacity;
+    }
+
+    // Sift up
+    VPEntry* items = iter->items;
+    size_t i = iter->num_items++;
+    while (i && items[(i - 1) / 2].distance > distance) {
+        items[i] = items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    items[i].item = item;
+    items[i].distance = distance;
+    return true;
+}
+
+static inline VPEntry
+__VPT_neighbors_pop(VPTNeighborIterator* iter) {
+    VPEntry* items = iter->items;
+    VPEntry top = items[0];
+    VPEntry last = items[--iter->num_items];
+
+    // Sift the last item down from the root
+    size_t i = 0, child;
+    while ((child = 2 * i + 1) < iter->num_items) {
+        if (child + 1 < iter->num_items && items[child + 1].distance < items[child].distance) child++;
+        if (!(items[child].distance < last.distance)) break;
+        items[i] = items[child];
+        i = child;
+    }
+    items[i] = last;
+    return top;
+}
+
+/**
+ * Starts iterating over the items of the tree in order of their distance to 
+ * a query, nearest first, for when you don't know how many neighbors you 
+ * need. Each call to VPT_neighbors_next() searches only as much more of the 
+ * tree as it takes to be sure of the next neighbor, so getting the first k 
+ * costs about as much as VPT_knn() with config.best_first.
+ * 
+ * The tree must not be rebuilt or destroyed until the iterator is destroyed.
+ * 
+ * @param iter The iterator to start.
+ * @param vpt The tree to iterate over.
+ * @param datapoint The query point.
+ * @return true on success, false if out of memory. 
+ *         Destroy the iterator with VPT_neighbors_destroy() either way.
+ */
+static inline bool
+VPT_neighbors_init(VPTNeighborIterator* iter, VPTree* vpt, vpt_t datapoint) {
+    iter->vpt = vpt;
+    iter->query = datapoint;
+    iter->num_items = 0;
+    iter->items_capacity = VPT_BEST_FIRST_QUEUE_SIZE;
+    iter->items = (VPEntry*)malloc(VPT_BEST_FIRST_QUEUE_SIZE * sizeof(VPEntry));
+
+    // The queue has no buffer on the C stack to start out in.
+    VPQueueEntry* entries = (VPQueueEntry*)malloc(VPT_BEST_FIRST_QUEUE_SIZE * sizeof(VPQueueEntry));
+    __VPT_queue_init(&(iter->subtrees), NULL, entries ? VPT_BEST_FIRST_QUEUE_SIZE : 0);
+    iter->subtrees.entries = entries;
+    if (!iter->items || !entries) return false;
+
+    if (vpt->size) __VPT_queue_push(&(iter->subtrees), 0, vpt->root, 0);
+    return true;
+}
+
+/**
+ * Gets the next nearest neighbor from an iterator. Neighbors come in order of 
+ * their distance to the query, and every item in the tree comes exactly once.
+ * 
+ * @param iter The iterator, from VPT_neighbors_init().
+ * @param neighbor Where to write the next neighbor, if there is one.
+ * @param found Set to whether there was a next neighbor. 
+ *              Once every item in the tree has been returned, there isn't.
+ * @return true on success, false if out of memory.
+ */
+static inline bool
+VPT_neighbors_next(VPTNeighborIterator* iter, VPEntry* neighbor, bool* found) {
+    VPTree* vpt = iter->vpt;
+    VPQueue* subtrees = &(iter->subtrees);
+    bool success = true;
+
+    // Until the nearest item found is nearer than anything in the nearest 
+    // subtree could be, search the nearest subtree.
+    while (success && subtrees->size && (!iter->num_items || subtrees->entries[0].bound < iter->items[0].distance)) {
+        VPQueueEntry popped = __VPT_queue_pop(subtrees);
+        VPNode* current_node = popped.subtree.node;
+
+        if (current_node->ulabel == 'b') {
+            VPBranch* branch = &(current_node->u.branch);
+            dist_t dist = vpt->dist_fn(vpt->extra_data, branch->item, iter->query);
+            success = __VPT_neighbors_push(iter, branch->item, dist);
+
+            // A subtree is at least as far as its parent was.
+            dist_t left_bound = __VPT_shell_lower_bound(dist, branch->left_min, branch->radius);
+            dist_t right_bound = __VPT_shell_lower_bound(dist, branch->right_min, branch->right_max);
+            if (left_bound < popped.bound) left_bound = popped.bound;
+            if (right_bound < popped.bound) right_bound = popped.bound;
+            if (success) success = __VPT_queue_push(subtrees, left_bound, branch->left, dist);
+            if (success) success = __VPT_queue_push(subtrees, right_bound, branch->right, dist);
+        } else if (current_node->ulabel == 'm') {
+            VPMulti* multi = &(current_node->u.multi);
+            dist_t dists[2];
+            for (size_t v = 0; success && v < 2; v++) {
+                dists[v] = vpt->dist_fn(vpt->extra_data, multi->items[v], iter->query);
+                success = __VPT_neighbors_push(iter, multi->items[v], dists[v]);
+            }
+
+            size_t num_children = multi->fanout * multi->fanout;
+            for (size_t c = 0; success && c < num_children; c++) {
+                dist_t bound = __VPT_multi_lower_bound(multi->children + c, dists[0], dists[1]);
+                if (bound < popped.bound) bound = popped.bound;
+                success = __VPT_queue_push(subtrees, bound, multi->children[c].node, dists[1]);
+            }
+        } else {
+            size_t vplist_size = current_node->u.pointlist.size;
+            vpt_t* vplist = current_node->u.pointlist.items;
+            for (size_t i = 0; success && i < vplist_size; i++)
+                success = __VPT_neighbors_push(iter, vplist[i], vpt->dist_fn(vpt->extra_data, vplist[i], iter->query));
+        }
+    }
+
+    *found = success && iter->num_items;
+    if (*found) *neighbor = __VPT_neighbors_pop(iter);
+    return success;
+}
+
+/**
+ * Frees the memory held by an iterator from VPT_neighbors_init(). 
+ * 
+ * @param iter The iterator to destroy.
+ */
+static inline void
+VPT_neighbors_destroy(VPTNeighborIterator* iter) {
+    __VPT_queue_free(&(iter->subtrees));
+    free(iter->items);
+}
+
+// Used in VPT_knn_cost
+struct VPCountingDist {
+    dist_t (*dist_fn)(void* extra_data, vpt_t first, vpt_t second);
+    void* extra_data;
+    size_t num_calls;
+};
+typedef struct VPCountingDist VPCountingDist;
+
+static inline dist_t
+__VPT_counting_dist(void* counter, vpt_t first, vpt_t second) {
+    VPCountingDist* counting = (VPCountingDist*)counter;
+    counting->num_calls++;
+    return counting->dist_fn(counting->extra_data, first, second);
+}
+
+/**
+ * Measures how many times a k-nearest-neighbor search calls the tree's distance 
+ * function, on average, by running VPT_knn() for each of the sample queries. 
+ * Use it to compare trees built with different options, such as vp_strategy.
+ * 
+ * Do not query the tree from other threads while this runs.
+ * 
+ * @param vpt The VPTree to measure.
+ * @param queries The sample query points.
+ * @param num_queries The number of sample query points.
+ * @param k The number of neighbors to search for.
+ * @return The mean number of distance calculations per query.
+ */
+static inline double
+VPT_knn_cost(VPTree* vpt, vpt_t* queries, size_t num_queries, size_t k) {
+    if (!num_queries || !k) return 0;
+
+    VPEntry* result_space = (VPEntry*)malloc(k * sizeof(VPEntry));
+    if (!result_space) return 0;
+    size_t num_results;
+
+    // Count the calls by standing in for the distance function.
+    VPCountingDist counting;
+    counting.dist_fn = vpt->dist_fn;
+    counting.extra_data = vpt->extra_data;
+    counting.num_calls = 0;
+    vpt->dist_fn = __VPT_counting_dist;
+    vpt->extra_data = &counting;
+
+    for (size_t i = 0; i < num_queries; i++)
+        VPT_knn(vpt, queries[i], k, result_space, &num_results);
+
+    vpt->dist_fn = counting.dist_fn;
+    vpt->extra_data = counting.extra_data;
+    free(result_space);
+    return (double)counting.num_calls / (double)num_queries;
+}
+
+static inline double
+__VPT_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1000000.0;
+}
+
+/**
+ * Picks leaf_size and sort_threshold for building a tree out of the given data. 
+ * 
+ * Builds trees out of a random sample of the data, one for each candidate 
+ * setting, and times both the build and VPT_knn() queries for other items of 
+ * the data against it. The config with the lowest total time for one build 
+ * and queries_per_build queries is written to tuned.
+ * 
+ * @param data The data the tree will be built out of.
+ * @param num_items The size of the data array.
+ * @param dist_fn A metric on the metric space of values of vpt_t.
+ * @param extra_data Additional information to be passed to the dist_fn callback.
+ * @param base The options to start from, or NULL for the defaults. Everything 
+ *             but leaf_size and sort_threshold is copied to tuned as is.
+ * @param queries_per_build How many queries you expect to run on each tree 
+ *             you build. This is what weighs build time against query time.
+ * @param tuned Where to write the chosen config.
+ * @return true on success, false if out of memory.
+ */
+static inline bool
+VPT_autotune(vpt_t* data, size_t num_items,
+             dist_t (*dist_fn)(void* extra_data, vpt_t first, vpt_t second), void* extra_data,
+             const VPTConfig* base, size_t queries_per_build, VPTConfig* tuned) {
+    static const size_t leaf_sizes[] = {8, 16, 32, 64, 100, 200, 400};
+    static const size_t sort_thresholds[] = {500, 1000, 2000, 4000, 8000};
+    const size_t num_leaf_sizes = sizeof(leaf_sizes) / sizeof(*leaf_sizes);
+    const size_t num_sort_thresholds = sizeof(sort_thresholds) / sizeof(*sort_thresholds);
+
+    *tuned = base ? *base : VPT_default_config();
+    if (!num_items) return true;
+
+    // Sample the data to build with, and some more of it to query with.
+    size_t i, j, sample_size = min(num_items, VPT_AUTOTUNE_SAMPLE_SIZE);
+    size_t num_queries = VPT_AUTOTUNE_NUM_QUERIES;
+    vpt_t* sample = (vpt_t*)malloc((sample_size + num_queries) * sizeof(vpt_t));
+    if (!sample) return false;
+    vpt_t* queries = sample + sample_size;
+    uint64_t rng = tuned->vp_seed;
+    for (i = 0; i < sample_size; i++)
+        sample[i] = data[sample_size == num_items ? i : __VPT_rand(&rng) % num_items];
+    for (i = 0; i < num_queries; i++)
+        queries[i] = data[__VPT_rand(&rng) % num_items];
+
+    VPEntry* result_space = (VPEntry*)malloc(VPT_AUTOTUNE_K * sizeof(VPEntry));
+    if (!result_space) {
+        free(sample);
+        return false;
+    }
+    size_t num_results;
+
+    // The sort threshold only matters if there's sorting.
+    size_t num_candidates = num_leaf_sizes * (tuned->median_selection ? 1 : num_sort_thresholds);
+    double best_cost = (double)DIST_MAX;
+    VPTConfig best = *tuned;
+    VPTConfig candidate = *tuned;
+    candidate.small_tree_size = 0;
+
+    for (i = 0; i < num_candidates; i++) {
+        candidate.leaf_size = leaf_sizes[i % num_leaf_sizes];
+        if (!tuned->median_selection) candidate.sort_threshold = sort_thresholds[i / num_leaf_sizes];
+
+        VPTree vpt;
+        double start = __VPT_now_ms();
+        bool success = VPT_build_config(&vpt, sample, sample_size, dist_fn, extra_data, &candidate);
+        double build_ms = __VPT_now_ms() - start;
+        if (!success) {
+            // Frees what was built before running out of memory.
+            VPT_destroy(&vpt);
+            free(result_space);
+            free(sample);
+            return false;
+        }
+
+        start = __VPT_now_ms();
+        for (j = 0; j < num_queries; j++)
+            VPT_knn(&vpt, queries[j], VPT_AUTOTUNE_K, result_space, &num_results);
+        double query_ms = (__VPT_now_ms() - start) / (double)num_queries;
+        VPT_destroy(&vpt);
+
+        double cost = build_ms + (double)queries_per_build * query_ms;
+        LOG("Autotune candidate cost: %f ms\n", cost);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best.leaf_size = candidate.leaf_size;
+            best.sort_threshold = candidate.sort_threshold;
+        }
+    }
+
+    *tuned = best;
+    free(result_space);
+    free(sample);
+    return true;
+}
+
+/**
+ * Performs a nearest-neighbor search on the Vantage Point Tree, finding the closest
+ * datapoint in the tree to the one provided, according to the distance function for 
+ * the VPTree.
+ * 
+ * The result is written to result_space, which should have enough space for a VPEntry.
+ * If the tree is empty, the result's distance is DIST_MAX, and its item is left as is.
+ * 
+ * @return true on success, false if out of memory. Memory is only 
+ *         allocated for trees taller than VPT_MAX_HEIGHT, or when searching 
+ *         best first, once more than VPT_BEST_FIRST_QUEUE_SIZE subtrees 
+ *         are waiting to be searched.
+ */
+static inline bool
+VPT_nn(VPTree* vpt, vpt_t datapoint, VPEntry* result_space) {
+    size_t num_results;
+    if (vpt->cache && __VPT_cache_get(vpt, datapoint, 1, 0, &result_space, &num_results)) return true;
+    if (vpt->config.best_first) {
+        VPEntry knnlist[2];
+        if (!__VPT_knn_best_first(vpt, datapoint, 1, knnlist, result_space, &num_results, 0, 0, NULL, NULL))
+            return false;
+        if (!num_results) result_space->distance = (dist_t) DIST_MAX;
+        else if (vpt->cache) __VPT_cache_put(vpt, datapoint, 1, 0, result_space, num_results);
+        return true;
+    }
+
+    __VPT_STATS_BEGIN;
+    dist_t dist;
+    vpt_t* closest = NULL;
+    dist_t closest_dist = (dist_t) DIST_MAX;
+
+    size_t to_traverse_size = 1;
+    NodeDistTuple stack_buffer[VPT_MAX_HEIGHT];
+    NodeDistTuple* to_traverse = __VPT_traversal_stack(vpt, stack_buffer);
+    VPNode* current_node;
+    if (!to_traverse) return false;
+    to_traverse[0].node = vpt->root;
+    to_traverse[0].dist = 0;
+
+    // Traverse the tree
+    while (to_traverse_size) {
+        // Pop a node from the stack
+        NodeDistTuple popped = to_traverse[--to_traverse_size];
+        current_node = popped.node;
+
+        // If branch
+        if (current_node->ulabel == 'b') {
+            // Calculate and consider this item's distance
+            dist = vpt->dist_fn(vpt->extra_data, current_node->u.branch.item, datapoint);
+            __VPT_STAT(dist_calls, 1);
+            __VPT_STAT(branches_visited, 1);
+            __VPT_STAT(subtrees_pruned, 2);
+
+            // Update new closest
+            if (dist < closest_dist) {
+                closest_dist = dist;
+                closest = &(current_node->u.branch.item);
+            }
+
+            // Recurse down the tree, searching the side the query is on first
+            VPBranch* branch = &(current_node->u.branch);
+            bool search_left = dist - closest_dist <= branch->radius && dist + closest_dist >= branch->left_min;
+            bool search_right = dist + closest_dist >= branch->right_min && dist - closest_dist <= branch->right_max;
+            if (dist > branch->radius) {
+                if (search_left) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->left, dist};
+                if (search_right) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->right, dist};
             } else {
-                size_t listsize = node.u.pointlist.size;
-                for (size_t j = 0; j < listsize; j++) {
-                    vpt_t item = node.u.pointlist.items[j];
-                    all_items[all_size++] = item;
+                if (search_right) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->right, dist};
+                if (search_left) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->left, dist};
+            }
+            __VPT_STAT_STACK(to_traverse_size);
+        }
+        // If multi-vantage-point branch
+        else if (current_node->ulabel == 'm') {
+            VPMulti* multi = &(current_node->u.multi);
+            dist_t dists[2];
+            for (size_t v = 0; v < 2; v++) {
+                dists[v] = vpt->dist_fn(vpt->extra_data, multi->items[v], datapoint);
+                if (dists[v] < closest_dist) {
+                    closest_dist = dists[v];
+                    closest = multi->items + v;
+                }
+            }
+            __VPT_STAT(dist_calls, 2);
+            __VPT_STAT(branches_visited, 1);
+
+            // Search the children whose shells the query is in first
+            size_t num_children = multi->fanout * multi->fanout;
+            __VPT_STAT(subtrees_pruned, num_children);
+            for (int contains_query = 0; contains_query < 2; contains_query++) {
+                for (size_t c = 0; c < num_children; c++) {
+                    dist_t bound = __VPT_multi_lower_bound(multi->children + c, dists[0], dists[1]);
+                    if (bound <= closest_dist && (bound == 0) == contains_query)
+                        to_traverse[to_traverse_size++] = (NodeDistTuple){multi->children[c].node, dists[1]};
+                }
+            }
+            __VPT_STAT_STACK(to_traverse_size);
+        }
+        // If pointlist
+        else {
+            size_t listsize = current_node->u.pointlist.size;
+            vpt_t* pointlist = current_node->u.pointlist.items;
+            dist_t* pointdists = current_node->u.pointlist.distances;
+
+            // Search for smaller items in the list
+            __VPT_STAT(leaves_scanned, 1);
+            for (size_t i = 0; i < listsize; i++) {
+                if (pointdists && __VPT_dist_lower_bound(popped.dist, pointdists[i]) >= closest_dist) continue;
+                dist = vpt->dist_fn(vpt->extra_data, pointlist[i], datapoint);
+                __VPT_STAT(dist_calls, 1);
+
+                if (dist < closest_dist) {
+                    closest_dist = dist;
+                    closest = pointlist + i;
                 }
             }
         }
-        NodeAllocs* consumed_alloc_list = node_allocs;
-        node_allocs = node_allocs->next;
-        free(consumed_alloc_list);
     }
 
-    ListAllocs* list_allocs = vpt->allocator.list_allocs;
-    while (list_allocs) {
-        ListAllocs* consumed_list_allocs = list_allocs;
-        list_allocs = list_allocs->next;
-        free(consumed_list_allocs);
+    __VPT_free_traversal_stack(to_traverse, stack_buffer);
+    __VPT_STATS_END(vpt);
+    result_space->distance = closest_dist;
+    if (closest) {
+        result_space->item = *closest;
+        if (vpt->cache) __VPT_cache_put(vpt, datapoint, 1, 0, result_space, 1);
     }
+    return true;
+}
 
-    // Assert all_size == vpt->size
-    LOGs("Tree disassembly complete.");
-    return all_items;
+
+
+// Calls the visitor with each item within max_dist of the datapoint in the subtree 
+// under root, until it returns false. root must be the tree's root or a branch. 
+// Returns false if out of memory, which can only happen for trees taller than VPT_MAX_HEIGHT.
+static inline bool
+__VPT_within(VPTree* vpt, VPNode* root, vpt_t datapoint, dist_t max_dist, VPVisitor visitor, void* user_data) {
+    // max_dist is equivalent to tau from VPT_knn. It's just that we 
+    // already know tau, we don't approximate it.
+
+    __VPT_STATS_BEGIN;
+
+    // Initialize traversal stack
+    size_t to_traverse_size = 1;
+    NodeDistTuple stack_buffer[VPT_MAX_HEIGHT];
+    NodeDistTuple* to_traverse = __VPT_traversal_stack(vpt, stack_buffer);
+    if (!to_traverse) return false;
+    to_traverse[0].node = root;
+    to_traverse[0].dist = 0;
+    
+    // Traverse the tree by the same method used in VPT_knn()
+    VPNode* current_node;
+    while (to_traverse_size) {
+        // Pop a node from the stack and calculate the distance to it.
+        NodeDistTuple popped = to_traverse[--to_traverse_size];
+        current_node = popped.node;
+
+        if (current_node->ulabel == 'b') {
+            // Calculate the distance between the current node and the query point.
+            dist_t dist = vpt->dist_fn(vpt->extra_data, current_node->u.branch.item, datapoint);
+            __VPT_STAT(dist_calls, 1);
+            __VPT_STAT(branches_visited, 1);
+            __VPT_STAT(subtrees_pruned, 2);
+
+            // If the distance is within the threshold, visit this node's item.
+            if (dist <= max_dist && !visitor(user_data, current_node->u.branch.item, dist)) break;
+            
+            // Push the branches of the tree that could still contain matches 
+            // onto the stack to be processed. Only the shells the search 
+            // radius reaches can.
+            VPBranch* branch = &(current_node->u.branch);
+            if (dist - max_dist <= branch->radius && dist + max_dist >= branch->left_min)
+                to_traverse[to_traverse_size++] = (NodeDistTuple){branch->left, dist};
+            if (dist + max_dist >= branch->right_min && dist - max_dist <= branch->right_max)
+                to_traverse[to_traverse_size++] = (NodeDistTuple){branch->right, dist};
+            __VPT_STAT_STACK(to_traverse_size);
+
+        }
+
+        // If it's a multi-vantage-point branch, do the same with both vantage points.
+        else if (current_node->ulabel == 'm') {
+            VPMulti* multi = &(current_node->u.multi);
+            dist_t dists[2];
+            bool stop = false;
+            for (size_t v = 0; v < 2 && !stop; v++) {
+                dists[v] = vpt->dist_fn(vpt->extra_data, multi->items[v], datapoint);
+                __VPT_STAT(dist_calls, 1);
+                stop = dists[v] <= max_dist && !visitor(user_data, multi->items[v], dists[v]);
+            }
+            __VPT_STAT(branches_visited, 1);
+            size_t num_children = multi->fanout * multi->fanout;
+            __VPT_STAT(subtrees_pruned, num_children);
+            if (stop) break;
+
+            for (size_t c = 0; c < num_children; c++) {
+                if (__VPT_multi_lower_bound(multi->children + c, dists[0], dists[1]) <= max_dist)
+                    to_traverse[to_traverse_size++] = (NodeDistTuple){multi->children[c].node, dists[1]};
+            }
+            __VPT_STAT_STACK(to_traverse_size);
+        } 
+        
+        // If the VPNode popped off the traversal stack is a list
+        else {
+            size_t vplist_size = current_node->u.pointlist.size;
+            vpt_t* vplist = current_node->u.pointlist.items;
+            dist_t* vpdists = current_node->u.pointlist.distances;
+
+            // For each item in the list, calculate the distance between the datapoint and the item.
+            // If the item is within max_dist, visit it.
+            __VPT_STAT(leaves_scanned, 1);
+            bool stop = false;
+            for (size_t i = 0; i < vplist_size; i++) {
+                if (vpdists && __VPT_dist_lower_bound(popped.dist, vpdists[i]) > max_dist) continue;
+
+                dist_t dist = vpt->dist_fn(vpt->extra_data, vplist[i], datapoint);
+                __VPT_STAT(dist_calls, 1);
+
+                if (dist <= max_dist && !visitor(user_data, vplist[i], dist)) {
+                    stop = true;
+                    break;
+                }
+            }
+            if (stop) break;
+        }
+    }
+
+    __VPT_free_traversal_stack(to_traverse, stack_buffer);
+    __VPT_STATS_END(vpt);
+    return true;
+}
+
+
+struct WithinList {
+    VPEntry* items;
+    size_t num_items;
+    size_t capacity;
+    bool oom;
+};
+typedef struct WithinList WithinList;
+
+// Appends a match to a WithinList, growing it as needed.
+static inline bool
+__VPT_within_append(void* user_data, vpt_t item, dist_t distance) {
+    WithinList* all_within = (WithinList*)user_data;
+    if (all_within->num_items == all_within->capacity) {
+        size_t new_size = 2 * all_within->capacity;
+        VPEntry* new_buf = (VPEntry*)realloc(all_within->items, sizeof(VPEntry) * new_size);
+        if (!new_buf) {
+            all_within->oom = true;
+            return false;
+        }
+        all_within->capacity = new_size;
+        all_within->items = new_buf;
+    }
+    all_within->items[all_within->num_items].item = item;
+    all_within->items[all_within->num_items].distance = distance;
+    all_within->num_items++;
+    return true;
+}
+
+struct WithinCount {
+    size_t count;
+    size_t limit;
+};
+typedef struct WithinCount WithinCount;
+
+static inline bool
+__VPT_within_count(void* user_data, vpt_t item, dist_t distance) {
+    (void)item;
+    (void)distance;
+    WithinCount* counter = (WithinCount*)user_data;
+    return ++counter->count != counter->limit;
 }
 
+
 /**
- * Rebuilds this Vantage Point Tree using the points already inside of it.
+ * Finds all the items in the tree within max_dist of the datapoint.
  * 
- * As you add points to the tree using VPT_add, the tree may become unbalanced.
- * At some point for efficiency of querying the tree, it becomes worth it to 
- * rebuild the tree to balance it.
+ * @param vpt The tree to search.
+ * @param datapoint The point to search around.
+ * @param max_dist The distance to search within, inclusive.
+ * @param result_space Set to a buffer on the heap holding the matches, in no 
+ *                     particular order. The caller must free it, even if this 
+ *                     function returns false.
+ * @param num_results Set to the number of matches in the result space.
+ * @return false if out of memory, true otherwise.
+ */
+static inline bool
+VPT_all_within(VPTree* vpt, vpt_t datapoint, dist_t max_dist, VPEntry** result_space, size_t* num_results) {
+    *result_space = NULL;
+    if (vpt->cache && __VPT_cache_get(vpt, datapoint, 0, max_dist, result_space, num_results)) return true;
+
+    // Take a guess and allocate a fairly large buffer to store the results.
+    WithinList all_within;
+    all_within.items = (VPEntry*)malloc(sizeof(VPEntry) * VPT_MAX_LIST_SIZE);
+    all_within.num_items = 0;
+    all_within.capacity = VPT_MAX_LIST_SIZE; 
+    all_within.oom = false;
+
+    *num_results = 0;
+    if (!all_within.items) {
+        *result_space = NULL;
+        return false;
+    }
+
+    bool success = __VPT_within(vpt, vpt->root, datapoint, max_dist, __VPT_within_append, &all_within);
+
+    // The buffer may have moved while growing, so assign it only once we're done.
+    *result_space = all_within.items;
+    *num_results = all_within.num_items;
+    success = success && !all_within.oom;
+    if (success && vpt->cache) __VPT_cache_put(vpt, datapoint, 0, max_dist, all_within.items, all_within.num_items);
+    return success;
+}
+
+/**
+ * Calls a visitor with each item in the tree within max_dist of the datapoint,
+ * in no particular order, without allocating space for the results. The search 
+ * stops as soon as the visitor returns false.
  * 
- * @param vpt The Vantage Point Tree to rebuild.
- * @return true on success, false if out of memory.
- *             No guaruntees on the state of the tree on failure.
+ * @param vpt The tree to search.
+ * @param datapoint The point to search around.
+ * @param max_dist The distance to search within, inclusive.
+ * @param visitor Called with user_data, each match, and its distance to the 
+ *                datapoint. Returns whether to keep searching.
+ * @param user_data Passed through to the visitor.
+ * @return false if out of memory, which can only happen for trees taller than
+ *         VPT_MAX_HEIGHT, and true otherwise, including when the visitor stops 
+ *         the search.
  */
-static inline bool 
-VPT_rebuild(VPTree* vpt) {
-    vpt_t* items = VPT_teardown(vpt);
-    if (!items) return false;
+static inline bool
+VPT_within_visit(VPTree* vpt, vpt_t datapoint, dist_t max_dist, VPVisitor visitor, void* user_data) {
+    return __VPT_within(vpt, vpt->root, datapoint, max_dist, visitor, user_data);
+}
 
-    bool success = VPT_build(vpt, items, vpt->size, vpt->dist_fn, vpt->extra_data);
-    if (!success) return false;
+/**
+ * Counts the items in the tree within max_dist of the datapoint, without 
+ * allocating space for them. Counting stops at the limit, so a limit of 1 
+ * answers whether there's anything within max_dist at all.
+ * 
+ * @param vpt The tree to search.
+ * @param datapoint The point to search around.
+ * @param max_dist The distance to search within, inclusive.
+ * @param limit The most items to count, or 0 for no limit.
+ * @param count Set to the number of items found, at most limit.
+ * @return false if out of memory, which can only happen for trees taller than
+ *         VPT_MAX_HEIGHT, true otherwise.
+ */
+static inline bool
+VPT_count_within(VPTree* vpt, vpt_t datapoint, dist_t max_dist, size_t limit, size_t* count) {
+    WithinCount counter;
+    counter.count = 0;
+    counter.limit = limit;
+    bool success = __VPT_within(vpt, vpt->root, datapoint, max_dist, __VPT_within_count, &counter);
+    *count = counter.count;
+    return success;
+}
 
-    free(items);
+// Claims the next queries of a batch for the calling thread. Returns false when there are none left.
+static inline bool
+__VPT_batch_claim(VPQueryBatch* batch, size_t* first, size_t* last) {
+    if (atomic_load(&(batch->failed))) return false;
+    *first = atomic_fetch_add(&(batch->next_query), VPT_BATCH_GRAIN);
+    if (*first >= batch->num_queries) return false;
+    *last = min(*first + VPT_BATCH_GRAIN, batch->num_queries);
     return true;
 }
 
+static void*
+__VPT_knn_batch_worker(void* arg) {
+    VPQueryBatch* batch = (VPQueryBatch*)arg;
+    VPTree* vpt = batch->vpt;
+    size_t first, last;
+
+    // Each thread searches in its own space, which it reuses for every query.
+    VPEntry* knnlist = (VPEntry*) malloc(__VPT_KNNLIST_BUFFER_SIZE(batch->k) * sizeof(VPEntry));
+    NodeDistTuple stack_buffer[VPT_MAX_HEIGHT];
+    NodeDistTuple* to_traverse = __VPT_traversal_stack(vpt, stack_buffer);
+    if (!knnlist || !to_traverse) {
+        atomic_store(&(batch->failed), true);
+    } else {
+        while (__VPT_batch_claim(batch, &first, &last)) {
+            for (size_t i = first; i < last; i++) {
+                if (!vpt->config.best_first) {
+                    __VPT_knn(vpt, batch->queries[i], batch->k, knnlist, to_traverse,
+                              batch->knn_results + i * batch->k, batch->num_results + i);
+                } else if (!__VPT_knn_best_first(vpt, batch->queries[i], batch->k, knnlist,
+                                                 batch->knn_results + i * batch->k, batch->num_results + i, 0, 0,
+                                                 NULL, NULL)) {
+                    atomic_store(&(batch->failed), true);
+                }
+            }
+        }
+    }
+
+    if (to_traverse) __VPT_free_traversal_stack(to_traverse, stack_buffer);
+    free(knnlist);
+    return NULL;
+}
+
+static void*
+__VPT_all_within_batch_worker(void* arg) {
+    VPQueryBatch* batch = (VPQueryBatch*)arg;
+    size_t first, last;
+    while (__VPT_batch_claim(batch, &first, &last)) {
+        for (size_t i = first; i < last; i++) {
+            if (!VPT_all_within(batch->vpt, batch->queries[i], batch->max_dist,
+                                batch->within_results + i, batch->num_results + i))
+                atomic_store(&(batch->failed), true);
+        }
+    }
+    return NULL;
+}
+
+// The number of threads to run on, for num_threads of 0 meaning one per core.
+static inline size_t
+__VPT_num_threads(size_t num_threads) {
+    if (num_threads) return num_threads;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (size_t)online : 1;
+}
+
+// Runs worker(arg) on num_threads threads, including the calling one, and 
+// waits for them all. If a thread can't be started, the threads that did 
+// start have to pick up its share.
+static inline void
+__VPT_run_threads(size_t num_threads, void* (*worker)(void*), void* arg) {
+    pthread_t* threads = NULL;
+    size_t i, num_started = 0;
+    if (num_threads > 1) threads = (pthread_t*) malloc((num_threads - 1) * sizeof(pthread_t));
+    for (i = 0; threads && i < num_threads - 1; i++, num_started++) {
+        if (pthread_create(threads + i, NULL, worker, arg)) break;
+    }
+    worker(arg);
+    for (i = 0; i < num_started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+// Answers the batch on num_threads threads, including the calling one, or on 
+// one per core if num_threads is 0.
+static inline bool
+__VPT_run_batch(VPQueryBatch* batch, size_t num_threads, void* (*worker)(void*)) {
+    atomic_init(&(batch->next_query), 0);
+    atomic_init(&(batch->failed), false);
+
+    num_threads = __VPT_num_threads(num_threads);
+    num_threads = min(num_threads, (batch->num_queries + VPT_BATCH_GRAIN - 1) / VPT_BATCH_GRAIN);
+    __VPT_run_threads(num_threads, worker, batch);
+    return !atomic_load(&(batch->failed));
+}
+
 /**
- * Performs a k-nearest-neighbor search on the Vantage Point Tree, finding the 
- * k closest datapoints in the tree to the datapoint provided, according to the 
- * VPTree's distance function.
- * 
- * You are expected to provide the buffer result_space, which the results are 
- * written to. It should be of size equal to or greater than the size of 
- * "VPEntry result_space[k];", which is to say (k * sizeof(VPEntry)) bytes.
+ * Performs VPT_knn() for each of a batch of queries, spread across threads.
  * 
- * The number of results found is written to num_results. If the tree is 
- * empty, then no results are written. If k is larger than the tree, 
+ * The results for the i-th query are written to the i-th row of result_space, 
+ * a num_queries by k matrix. That is, they start at result_space + i * k. The 
+ * number of results for the i-th query is written to num_results[i].
  * 
- * @param vpt The VPTree to search.
- * @param datapoint The query point.
- * @param k The number of nearest points to the query point to fetch.
- * @param result_space
- * @param num_results
+ * @param vpt The VPTree to search. Its dist_fn must be safe to call from 
+ *            multiple threads at once.
+ * @param queries The query points.
+ * @param num_queries The number of query points.
+ * @param k The number of nearest points to each query point to fetch.
+ * @param result_space Space for (num_queries * k) VPEntries.
+ * @param num_results Space for num_queries counts.
+ * @param num_threads The number of threads to search with, including the 
+ *                    calling one, or 0 for one per core.
+ * @return true on success, false if out of memory. On failure, some of 
+ *         the queries may not have been answered.
  */
-static inline void
-VPT_knn(VPTree* vpt, vpt_t datapoint, size_t k, VPEntry* result_space, size_t* num_results) {
+static inline bool
+VPT_knn_batch(VPTree* vpt, vpt_t* queries, size_t num_queries, size_t k,
+              VPEntry* result_space, size_t* num_results, size_t num_threads) {
     if (!vpt->size || !k) {
-        *num_results = 0;
-        return;
+        for (size_t i = 0; i < num_queries; i++) num_results[i] = 0;
+        return true;
+    }
+
+    VPQueryBatch batch;
+    batch.vpt = vpt;
+    batch.queries = queries;
+    batch.num_queries = num_queries;
+    batch.k = k;
+    batch.knn_results = result_space;
+    batch.num_results = num_results;
+    return __VPT_run_batch(&batch, num_threads, __VPT_knn_batch_worker);
+}
+
+/**
+ * Performs VPT_all_within() for each of a batch of queries, spread across threads.
+ * 
+ * A buffer of the results for the i-th query is written to result_spaces[i], 
+ * and the number of results to num_results[i]. Each buffer is allocated with 
+ * malloc() and must be freed, even if this function fails. The buffers of any 
+ * queries that weren't answered are NULL.
+ * 
+ * @param vpt The VPTree to search. Its dist_fn must be safe to call from 
+ *            multiple threads at once.
+ * @param queries The query points.
+ * @param num_queries The number of query points.
+ * @param max_dist The distance within which to find items for each query.
+ * @param result_spaces Space for num_queries pointers to results.
+ * @param num_results Space for num_queries counts.
+ * @param num_threads The number of threads to search with, including the 
+ *                    calling one, or 0 for one per core.
+ * @return true on success, false if out of memory.
+ */
+static inline bool
+VPT_all_within_batch(VPTree* vpt, vpt_t* queries, size_t num_queries, dist_t max_dist,
+                     VPEntry** result_spaces, size_t* num_results, size_t num_threads) {
+    for (size_t i = 0; i < num_queries; i++) {
+        result_spaces[i] = NULL;
+        num_results[i] = 0;
+    }
+
+    VPQueryBatch batch;
+    batch.vpt = vpt;
+    batch.queries = queries;
+    batch.num_queries = num_queries;
+    batch.max_dist = max_dist;
+    batch.within_results = result_spaces;
+    batch.num_results = num_results;
+    return __VPT_run_batch(&batch, num_threads, __VPT_all_within_batch_worker);
+}
+
+
+static inline bool
+__VPT_join_push(VPJoinTasks* list, VPJoinTask task) {
+    if (list->size == list->capacity) {
+        size_t new_capacity = list->capacity ? 2 * list->capacity : VPT_MAX_HEIGHT;
+        VPJoinTask* new_tasks = (VPJoinTask*)realloc(list->tasks, new_capacity * sizeof(VPJoinTask));
+        if (!new_tasks) return false;
+        list->tasks = new_tasks;
+        list->capacity = new_capacity;
     }
+    list->tasks[list->size++] = task;
+    return true;
+}
+
+static inline bool
+__VPT_join_push_self(VPJoinTasks* list, VPJoinSide side) {
+    VPJoinTask task;
+    task.sides[0] = side;
+    task.sides[1] = side;
+    task.self_join = true;
+    return __VPT_join_push(list, task);
+}
 
-    // Create a temp buffer
-    size_t knnlist_size = 0;
-    VPEntry knnlist[k + VPT_MAX_LIST_SIZE];
+static inline bool
+__VPT_join_push_cross(VPJoinTasks* list, VPJoinSide first, VPJoinSide second) {
+    VPJoinTask task;
+    task.sides[0] = first;
+    task.sides[1] = second;
+    task.self_join = false;
+    return __VPT_join_push(list, task);
+}
+
+// The vantage point a side's shell is around.
+static inline vpt_t
+__VPT_join_center(VPJoinSide* side) {
+    VPNode* center = side->center;
+    return center->ulabel == 'b' ? center->u.branch.item : center->u.multi.items[side->center_index];
+}
 
-    // The largest distance to a knn
-    dist_t tau = (dist_t) DIST_MAX;
+// Hands a pair to the join's visitor. Returns false once the join should stop.
+static inline bool
+__VPT_join_report(VPSelfJoin* join, vpt_t first, vpt_t second, dist_t distance) {
+    if (atomic_load_explicit(&(join->stopped), memory_order_relaxed)) return false;
+    if (join->visitor(join->user_data, first, second, distance)) return true;
+    atomic_store(&(join->stopped), true);
+    return false;
+}
 
-    // Scratch space for processing vplist distances
-    dist_t vplist_distances[VPT_MAX_LIST_SIZE];
+static inline bool
+__VPT_join_point_visitor(void* user_data, vpt_t item, dist_t distance) {
+    VPJoinPoint* join_point = (VPJoinPoint*)user_data;
+    return __VPT_join_report(join_point->join, join_point->point, item, distance);
+}
 
-    // Now it's time to traverse the tree for the k-nearest datapoints we're looking for.
+// Finds the pairs of point and the items under node within eps of each other. 
+// Returns false once the join should stop.
+static inline bool
+__VPT_join_point(VPSelfJoin* join, vpt_t point, VPNode* node) {
+    VPTree* vpt = join->vpt;
+    if (node->ulabel == 'l') {
+        for (size_t i = 0; i < node->u.pointlist.size; i++) {
+            vpt_t item = node->u.pointlist.items[i];
+            dist_t dist = vpt->dist_fn(vpt->extra_data, point, item);
+            if (dist <= join->eps && !__VPT_join_report(join, point, item, dist)) return false;
+        }
+        return true;
+    }
 
-    // Prepare for warcrimes beyond this point. There are definitely a 
-    // lot of things here that could be split into multiple functions for 
-    // readability. "No premature optimizations," right? Well, I measured.
-    // It's definitely less readable this way, but it's a lot faster (~2x) not to 
-    // call a function for each jump in traversal. Instead of doing it recursively
-    // with the call stack, we use a loop and a normal stack.
+    VPJoinPoint join_point;
+    join_point.join = join;
+    join_point.point = point;
+    if (!__VPT_within(vpt, node, point, join->eps, __VPT_join_point_visitor, &join_point)) {
+        atomic_store(&(join->failed), true);
+        return false;
+    }
+    return !atomic_load_explicit(&(join->stopped), memory_order_relaxed);
+}
 
-    // Initialize a stack of nodes in the tree we still have to check
-    size_t to_traverse_size = 1;
-    VPNode* to_traverse[VPT_MAX_HEIGHT];
-    VPNode* current_node;
-    // push the root onto the stack of nodes to check
-    to_traverse[0] = vpt->root; 
+// Finds the pairs within the subtree of a side, and pushes the parts of 
+// that too big to do now onto tasks. Returns false once the join should stop.
+static inline bool
+__VPT_join_self(VPSelfJoin* join, VPJoinSide side, VPJoinTasks* tasks) {
+    VPTree* vpt = join->vpt;
+    VPNode* node = side.node;
+    dist_t eps = join->eps;
+    size_t i, j;
+
+    if (node->ulabel == 'l') {
+        // Items whose distances to the parent's vantage point are more than 
+        // eps apart are more than eps apart themselves.
+        vpt_t* items = node->u.pointlist.items;
+        dist_t* dists = node->u.pointlist.distances;
+        for (i = 0; i < node->u.pointlist.size; i++) {
+            for (j = i + 1; j < node->u.pointlist.size; j++) {
+                if (dists && __VPT_dist_lower_bound(dists[i], dists[j]) > eps) continue;
+                dist_t dist = vpt->dist_fn(vpt->extra_data, items[i], items[j]);
+                if (dist <= eps && !__VPT_join_report(join, items[i], items[j], dist)) return false;
+            }
+        }
+        return true;
+    }
 
-    // When we need to check a part of the tree, we push the root node of that subtree onto the stack. 
-    // That way, processing the stack until there are no more items left is equivalent to checking every
-    // necessary part of the tree.
-    while (to_traverse_size) {
-        // Pop a node from the stack
-        current_node = to_traverse[--to_traverse_size];
+    // Pair each vantage point with the subtrees whose shells come within eps 
+    // of it. Then pair up the items within each subtree, and between each pair 
+    // of subtrees whose shells come within eps of each other.
+    bool success = true;
+    if (node->ulabel == 'b') {
+        VPBranch* branch = &(node->u.branch);
+        VPJoinSide left = {branch->left, node, 0, branch->left_min, branch->radius};
+        VPJoinSide right = {branch->right, node, 0, branch->right_min, branch->right_max};
+        if (left.min <= eps && !__VPT_join_point(join, branch->item, left.node)) return false;
+        if (right.min <= eps && !__VPT_join_point(join, branch->item, right.node)) return false;
+        success = __VPT_join_push_self(tasks, left) && __VPT_join_push_self(tasks, right);
+        if (success && right.min - left.max <= eps) success = __VPT_join_push_cross(tasks, left, right);
+    } else {
+        VPMulti* multi = &(node->u.multi);
+        size_t num_children = multi->fanout * multi->fanout;
+        dist_t between = vpt->dist_fn(vpt->extra_data, multi->items[0], multi->items[1]);
+        if (between <= eps && !__VPT_join_report(join, multi->items[0], multi->items[1], between)) return false;
+
+        for (i = 0; i < num_children; i++) {
+            VPMultiChild* child = multi->children + i;
+            if (__VPT_multi_lower_bound(child, 0, between) <= eps && !__VPT_join_point(join, multi->items[0], child->node))
+                return false;
+            if (__VPT_multi_lower_bound(child, between, 0) <= eps && !__VPT_join_point(join, multi->items[1], child->node))
+                return false;
+        }
+        for (i = 0; success && i < num_children; i++) {
+            VPMultiChild* child = multi->children + i;
+            VPJoinSide child_side = {child->node, node, 1, child->min[1], child->max[1]};
+            success = __VPT_join_push_self(tasks, child_side);
+            for (j = i + 1; success && j < num_children; j++) {
+                // The shells around either vantage point can rule out the pair.
+                VPMultiChild* other = multi->children + j;
+                dist_t gap = 0;
+                for (size_t v = 0; v < 2; v++) {
+                    if (child->min[v] - other->max[v] > gap) gap = child->min[v] - other->max[v];
+                    if (other->min[v] - child->max[v] > gap) gap = other->min[v] - child->max[v];
+                }
+                VPJoinSide other_side = {other->node, node, 1, other->min[1], other->max[1]};
+                if (gap <= eps) success = __VPT_join_push_cross(tasks, child_side, other_side);
+            }
+        }
+    }
 
-        // If the node is a branch, 
-        if (current_node->ulabel == 'b') {
-            // Calculate the distance between this branch node and the target point.
-            dist_t dist = vpt->dist_fn(vpt->extra_data, current_node->u.branch.item, datapoint);
-            
-            // Push the node we're visiting onto the list of candidates and
-            // update tau when changes are made to the list.
-            __knnlist_push(knnlist, knnlist_size, current_node->u.branch.item, dist);  // Minimal to no actual sorting
-            knnlist_size = min(knnlist_size + 1, k);         // No branch on both x86 and ARM
-            tau = knnlist[max(knnlist_size - 1, 0)].distance;
+    if (!success) atomic_store(&(join->failed), true);
+    return success;
+}
 
-            // Keep track of the parts of the tree that could still have nearest neighbors, and push
-            // them onto the traversal stack. Keep doing this until we run out of tree to traverse.
-            if (dist < current_node->u.branch.radius) {
-                if (dist - tau <= current_node->u.branch.radius)
-                    to_traverse[to_traverse_size++] = current_node->u.branch.left;
-                if (dist + tau >= current_node->u.branch.radius)
-                    to_traverse[to_traverse_size++] = current_node->u.branch.right;
+// Finds the pairs between the subtrees of two sides, and pushes the parts of 
+// that too big to do now onto tasks. Returns false once the join should stop.
+static inline bool
+__VPT_join_cross(VPSelfJoin* join, VPJoinSide first, VPJoinSide second, VPJoinTasks* tasks) {
+    VPTree* vpt = join->vpt;
+    dist_t eps = join->eps;
+    size_t i, j;
+
+    // By the triangle inequality, with the distance between the vantage points 
+    // the shells are around, the shells can be too far apart to have any pairs.
+    dist_t centers = 0;
+    if (first.center != second.center || first.center_index != second.center_index)
+        centers = vpt->dist_fn(vpt->extra_data, __VPT_join_center(&first), __VPT_join_center(&second));
+    if (centers - first.max - second.max > eps) return true;
+    if (second.min - centers - first.max > eps) return true;
+    if (first.min - centers - second.max > eps) return true;
+
+    // Between two leaves, check every pair. With the items' distances to the 
+    // vantage points, some are too far apart in the same way as the shells.
+    VPNode* first_node = first.node;
+    VPNode* second_node = second.node;
+    if (first_node->ulabel == 'l' && second_node->ulabel == 'l') {
+        vpt_t* first_items = first_node->u.pointlist.items;
+        vpt_t* second_items = second_node->u.pointlist.items;
+        dist_t* first_dists = first_node->u.pointlist.distances;
+        dist_t* second_dists = second_node->u.pointlist.distances;
+        for (i = 0; i < first_node->u.pointlist.size; i++) {
+            // The distance from the first item to the second's vantage point is in [near, far].
+            dist_t near = 0, far = (dist_t) DIST_MAX;
+            if (first_dists) {
+                near = __VPT_dist_lower_bound(centers, first_dists[i]);
+                far = centers + first_dists[i];
+            }
+            for (j = 0; j < second_node->u.pointlist.size; j++) {
+                if (second_dists && (second_dists[j] - far > eps || near - second_dists[j] > eps)) continue;
+                dist_t dist = vpt->dist_fn(vpt->extra_data, first_items[i], second_items[j]);
+                if (dist <= eps && !__VPT_join_report(join, first_items[i], second_items[j], dist)) return false;
+            }
+        }
+        return true;
+    }
 
+    // Otherwise split the first side, if it's a branch, into its vantage points, 
+    // which search the other side, and its subtrees. The shells of whole 
+    // subtrees are too loose to rule much out, so once the first side is down 
+    // to a leaf, each of its items searches the other side on its own, which 
+    // can rule out the subtrees of the other side its shells don't reach.
+    // Like a search from the top of the tree, each item first checks whether 
+    // it's close enough to the other side's shell at all.
+    if (first_node->ulabel == 'l') {
+        vpt_t* items = first_node->u.pointlist.items;
+        dist_t* dists = first_node->u.pointlist.distances;
+        vpt_t center = __VPT_join_center(&second);
+        bool same_center = first.center == second.center && first.center_index == second.center_index;
+        for (i = 0; i < first_node->u.pointlist.size; i++) {
+            dist_t dist;
+            if (dists && same_center) {
+                dist = dists[i];
             } else {
-                if (dist + tau >= current_node->u.branch.radius)
-                    to_traverse[to_traverse_size++] = current_node->u.branch.right;
-                if (dist - tau <= current_node->u.branch.radius)
-                    to_traverse[to_traverse_size++] = current_node->u.branch.left;
+                if (dists && (__VPT_dist_lower_bound(centers, dists[i]) - second.max > eps ||
+                              second.min - (centers + dists[i]) > eps))
+                    continue;
+                dist = vpt->dist_fn(vpt->extra_data, items[i], center);
             }
+            if (__VPT_shell_lower_bound(dist, second.min, second.max) > eps) continue;
+            if (!__VPT_join_point(join, items[i], second_node)) return false;
         }
+        return true;
+    }
 
-        // If the node we popped is a list,
-        else {
-            // For each item in the list, calculate the distance between the datapoint and the item.
-            size_t vplist_size = current_node->u.pointlist.size;
-            vpt_t* vplist = current_node->u.pointlist.items;
-            for (size_t i = 0; i < vplist_size; i++) {
-                vplist_distances[i] = vpt->dist_fn(vpt->extra_data, vplist[i], datapoint);
-            }
+    bool success = true;
+    if (first_node->ulabel == 'b') {
+        VPBranch* branch = &(first_node->u.branch);
+        if (!__VPT_join_point(join, branch->item, second.node)) return false;
+        VPJoinSide left = {branch->left, first_node, 0, branch->left_min, branch->radius};
+        VPJoinSide right = {branch->right, first_node, 0, branch->right_min, branch->right_max};
+        success = __VPT_join_push_cross(tasks, left, second) && __VPT_join_push_cross(tasks, right, second);
+    } else {
+        VPMulti* multi = &(first_node->u.multi);
+        if (!__VPT_join_point(join, multi->items[0], second.node)) return false;
+        if (!__VPT_join_point(join, multi->items[1], second.node)) return false;
+        for (i = 0; success && i < multi->fanout * multi->fanout; i++) {
+            VPMultiChild* child = multi->children + i;
+            VPJoinSide child_side = {child->node, first_node, 1, child->min[1], child->max[1]};
+            success = __VPT_join_push_cross(tasks, child_side, second);
+        }
+    }
 
-            // Update the new k nearest neighbors
-            // 1. Break off the first k elements of the array (Already done)
-            // 2. Sort the first k elements (they happen to have already been constructed sorted)
-            // 3. Keep track of the largest distance to any of the k items. (This is tau, initialized 
-            //    earlier to infinity, or updated after any time __knnlist_push() is called.)
-            // 4. Iterate over the rest of the list. If the visited element is less than the
-            // largest element of the first k, swap it in and shift it into place so the list
-            // stays sorted. Then update the largest element. That's what we do below.
-            for (size_t i = 0; i < vplist_size; i++) {
-                if (vplist_distances[i] < tau) {
-                    __knnlist_push(knnlist, knnlist_size, vplist[i], vplist_distances[i]);
-                    knnlist_size = min(knnlist_size + 1, k);
-                    tau = knnlist[max(knnlist_size - 1, 0)].distance;
-                }
-            }
+    if (!success) atomic_store(&(join->failed), true);
+    return success;
+}
+
+static inline bool
+__VPT_join_task(VPSelfJoin* join, VPJoinTask task, VPJoinTasks* tasks) {
+    if (task.self_join) return __VPT_join_self(join, task.sides[0], tasks);
+    return __VPT_join_cross(join, task.sides[0], task.sides[1], tasks);
+}
+
+static void*
+__VPT_join_worker(void* arg) {
+    VPSelfJoin* join = (VPSelfJoin*)arg;
+    VPJoinTasks stack;
+    stack.tasks = NULL;
+    stack.size = stack.capacity = 0;
+
+    // Claim a task, and do all of it, depth first.
+    bool success = true;
+    while (success && !atomic_load(&(join->failed)) && !atomic_load(&(join->stopped))) {
+        size_t claimed = atomic_fetch_add(&(join->next_task), 1);
+        if (claimed >= join->num_tasks) break;
+        success = __VPT_join_push(&stack, join->tasks[claimed]);
+        while (success && stack.size) {
+            VPJoinTask task = stack.tasks[--stack.size];
+            success = __VPT_join_task(join, task, &stack);
         }
     }
 
-    // Copy the results into the result space and return
-    *num_results = knnlist_size;
-    for (size_t i = 0; i < knnlist_size; i++)
-        result_space[i] = knnlist[i];
-    return;
+    if (!success && !atomic_load(&(join->stopped))) atomic_store(&(join->failed), true);
+    free(stack.tasks);
+    return NULL;
 }
 
 /**
- * Performs a nearest-neighbor search on the Vantage Point Tree, finding the closest
- * datapoint in the tree to the one provided, according to the distance function for 
- * the VPTree.
+ * Finds every pair of items in the tree within eps of each other. Rather than 
+ * searching the tree once for each item, it searches subtrees against each 
+ * other, skipping pairs of subtrees whose shells are more than eps apart, so 
+ * each pair is found, and handed to the visitor, exactly once. The pairs come 
+ * in no particular order, and either item of a pair can come first.
  * 
- * The result is written to result_space, which should have enough space for a VPEntry.
+ * With VPT_STATS, the searches of subtrees for vantage points count as queries.
  * 
- * If no result is found (the tree is empty), writes false to result_found. Otherwise, true.
+ * @param vpt The VPTree to join with itself. Its dist_fn must be safe to call 
+ *            from multiple threads at once.
+ * @param eps The distance to find pairs within, inclusive.
+ * @param visitor Called with user_data, both items, and the distance between 
+ *                them, for each pair. It's called from multiple threads at 
+ *                once, unless num_threads is 1. Returns whether to keep going.
+ * @param user_data Passed through to the visitor.
+ * @param num_threads The number of threads to search with, including the 
+ *                    calling one, or 0 for one per core.
+ * @return false if out of memory, true otherwise, including when the visitor 
+ *         stops the join. On failure, some of the pairs may not have been found.
  */
-static inline void
-VPT_nn(VPTree* vpt, vpt_t datapoint, VPEntry* result_space) {
-    dist_t dist;
-    vpt_t closest;
-    dist_t closest_dist = (dist_t) DIST_MAX;
-
-    size_t to_traverse_size = 1;
-    VPNode* to_traverse[VPT_MAX_HEIGHT];
-    VPNode* current_node;
-    to_traverse[0] = vpt->root;
+static inline bool
+VPT_self_join(VPTree* vpt, dist_t eps, VPPairVisitor visitor, void* user_data, size_t num_threads) {
+    if (!vpt->size) return true;
+
+    VPSelfJoin join;
+    join.vpt = vpt;
+    join.eps = eps;
+    join.visitor = visitor;
+    join.user_data = user_data;
+    atomic_init(&(join.next_task), 0);
+    atomic_init(&(join.failed), false);
+    atomic_init(&(join.stopped), false);
+
+    // Break the join into enough tasks to go around, breadth first, so 
+    // they're all about the same size. Then hand them out to the threads.
+    num_threads = __VPT_num_threads(num_threads);
+    VPJoinTasks tasks;
+    tasks.tasks = NULL;
+    tasks.size = tasks.capacity = 0;
+    VPJoinSide root = {vpt->root, NULL, 0, 0, (dist_t) DIST_MAX};
+    bool success = __VPT_join_push_self(&tasks, root);
+    size_t first = 0;
+    while (success && first < tasks.size && tasks.size - first < num_threads * VPT_JOIN_TASKS_PER_THREAD)
+        success = __VPT_join_task(&join, tasks.tasks[first++], &tasks);
+
+    if (success) {
+        join.tasks = tasks.tasks + first;
+        join.num_tasks = tasks.size - first;
+        __VPT_run_threads(min(num_threads, join.num_tasks), __VPT_join_worker, &join);
+    }
 
-    // Traverse the tree
-    while (to_traverse_size) {
-        // Pop a node from the stack
-        current_node = to_traverse[--to_traverse_size];
+    free(tasks.tasks);
+    if (!success && !atomic_load(&(join.stopped))) return false;
+    return !atomic_load(&(join.failed));
+}
 
-        // If branch
-        if (current_node->ulabel == 'b') {
-            // Calculate and consider this item's distance
-            dist = vpt->dist_fn(vpt->extra_data, current_node->u.branch.item, datapoint);
 
-            // Update new closest
-            if (dist < closest_dist) {
-                closest_dist = dist;
-                closest = current_node->u.branch.item;
-            }
+// Lists the nodes of the tree depth first, with the position that each one's 
+// items start at, and writes the items in that order, unless items is NULL.
+static inline bool
+__VPT_node_rows(VPTree* vpt, vpt_t* items, VPNodeRow** nodes, size_t* num_nodes) {
+    NodeDistTuple stack_buffer[VPT_MAX_HEIGHT];
+    NodeDistTuple* to_traverse = __VPT_traversal_stack(vpt, stack_buffer);
+    if (!to_traverse) return false;
 
-            // Recurse down the tree
-            if (dist < current_node->u.branch.radius) {
-                if (dist - closest_dist <= current_node->u.branch.radius) {
-                    to_traverse[to_traverse_size++] = current_node->u.branch.left;
-                }
-                if (dist + closest_dist >= current_node->u.branch.radius) {
-                    to_traverse[to_traverse_size++] = current_node->u.branch.right;
-                }
-            } else {
-                if (dist + closest_dist >= current_node->u.branch.radius) {
-                    to_traverse[to_traverse_size++] = current_node->u.branch.right;
-                }
-                if (dist - closest_dist <= current_node->u.branch.radius) {
-                    to_traverse[to_traverse_size++] = current_node->u.branch.left;
-                }
+    size_t capacity = 0, row = 0, to_traverse_size = 1;
+    to_traverse[0].node = vpt->root;
+    while (to_traverse_size) {
+        VPNode* node = to_traverse[--to_traverse_size].node;
+        if (*num_nodes == capacity) {
+            capacity = capacity ? 2 * capacity : VPT_MAX_HEIGHT;
+            VPNodeRow* new_nodes = (VPNodeRow*)realloc(*nodes, capacity * sizeof(VPNodeRow));
+            if (!new_nodes) {
+                __VPT_free_traversal_stack(to_traverse, stack_buffer);
+                return false;
             }
+            *nodes = new_nodes;
         }
-        // If pointlist
-        else {
-            size_t listsize = current_node->u.pointlist.size;
-            vpt_t* pointlist = current_node->u.pointlist.items;
-
-            // Search for smaller items in the list
-            for (size_t i = 0; i < listsize; i++) {
-                dist = vpt->dist_fn(vpt->extra_data, pointlist[i], datapoint);
-
-                if (dist < closest_dist) {
-                    closest_dist = dist;
-                    closest = pointlist[i];
-                }
+        (*nodes)[(*num_nodes)++] = (VPNodeRow){node, row};
+
+        if (node->ulabel == 'b') {
+            if (items) items[row] = node->u.branch.item;
+            row++;
+            to_traverse[to_traverse_size++].node = node->u.branch.right;
+            to_traverse[to_traverse_size++].node = node->u.branch.left;
+        } else if (node->ulabel == 'm') {
+            VPMulti* multi = &(node->u.multi);
+            for (size_t v = 0; v < 2; v++, row++) {
+                if (items) items[row] = multi->items[v];
+            }
+            for (size_t c = multi->fanout * multi->fanout; c--;)
+                to_traverse[to_traverse_size++].node = multi->children[c].node;
+        } else {
+            for (size_t i = 0; i < node->u.pointlist.size; i++, row++) {
+                if (items) items[row] = node->u.pointlist.items[i];
             }
         }
     }
 
-    result_space->distance = closest_dist;
-    result_space->item = closest;
+    __VPT_free_traversal_stack(to_traverse, stack_buffer);
+    return true;
 }
 
+static inline int
+__VPT_node_row_compare(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((const VPNodeRow*)a)->node;
+    uintptr_t y = (uintptr_t)((const VPNodeRow*)b)->node;
+    return (x > y) - (x < y);
+}
 
+// Starts a list of the neighbors of an item of the graph, in space for k + 1 
+// entries and indices, which keeps the positions of the neighbors.
+static inline void
+__VPT_knn_graph_list(VPKnnGraphBuild* build, VPKnnList* list, VPEntry* entries, vpt_idx_t* indices) {
+    __VPT_knnlist_init(list, build->graph->k, entries, entries);
+    list->indices = indices;
+    list->rows = &(build->reference_rows);
+}
 
-// Used in VPT_all_within
-struct NodeDistTuple {
-    VPNode* node;
-    dist_t dist;
-};
-typedef struct NodeDistTuple NodeDistTuple;
+// Sorts the list of the neighbors of an item, and writes it to the given row of the graph.
+static inline void
+__VPT_knn_graph_row(VPKnnGraph* graph, size_t row, VPKnnList* list) {
+    size_t num_results;
+    __VPT_knnlist_finish(list, list->entries, &num_results);
+    for (size_t j = 0; j < num_results; j++) {
+        graph->indices[row * graph->k + j] = list->indices[j];
+        graph->distances[row * graph->k + j] = list->entries[j].distance;
+    }
+}
 
-struct WithinList {
-    VPEntry* items;
-    size_t num_items;
-    size_t capacity;
-};
-typedef struct WithinList WithinList;
+// Finds the neighbors of each item of a leaf. The distances between the items 
+// are calculated once, into leaf_dists, which is grown as needed. Then each 
+// item's search starts with the rest of the leaf as candidates, so tau is 
+// already small, and skips the leaf. The leaf can't have more than 
+// VPT_KNN_GRAPH_MAX_LEAF items, which keeps the matrix small, and its size 
+// from overflowing.
+static inline bool
+__VPT_knn_graph_leaf(VPKnnGraphBuild* build, VPNode* leaf, size_t first, VPEntry* knnlist_buffer,
+                     vpt_idx_t* indices, NodeDistTuple* to_traverse, dist_t** leaf_dists,
+                     size_t* leaf_dists_capacity) {
+    VPTree* vpt = build->vpt;
+    size_t num_items = leaf->u.pointlist.size;
+    vpt_t* items = leaf->u.pointlist.items;
+    if (num_items * num_items > *leaf_dists_capacity) {
+        dist_t* new_dists = (dist_t*)realloc(*leaf_dists, num_items * num_items * sizeof(dist_t));
+        if (!new_dists) return false;
+        *leaf_dists = new_dists;
+        *leaf_dists_capacity = num_items * num_items;
+    }
+
+    dist_t* dists = *leaf_dists;
+    for (size_t i = 0; i < num_items; i++) {
+        for (size_t j = i + 1; j < num_items; j++)
+            dists[i * num_items + j] = dists[j * num_items + i] = vpt->dist_fn(vpt->extra_data, items[i], items[j]);
+    }
 
+    for (size_t i = 0; i < num_items; i++) {
+        VPKnnList knnlist;
+        __VPT_knn_graph_list(build, &knnlist, knnlist_buffer, indices);
+        for (size_t j = 0; j < num_items; j++) {
+            if (j != i && dists[i * num_items + j] < knnlist.tau)
+                __VPT_knnlist_add_index(&knnlist, items[j], dists[i * num_items + j], first + j);
+        }
+        __VPT_knn_search(vpt, items[i], &knnlist, to_traverse, leaf, NULL, NULL, NULL);
+        __VPT_knn_graph_row(build->graph, first + i, &knnlist);
+    }
+    return true;
+}
+
+static void*
+__VPT_knn_graph_worker(void* arg) {
+    VPKnnGraphBuild* build = (VPKnnGraphBuild*)arg;
+    VPTree* vpt = build->vpt;
+    VPKnnGraph* graph = build->graph;
+
+    // Each thread searches in its own space, which it reuses for every item.
+    VPEntry* knnlist = (VPEntry*) malloc((graph->k + 1) * sizeof(VPEntry));
+    vpt_idx_t* indices = (vpt_idx_t*) malloc((graph->k + 1) * sizeof(vpt_idx_t));
+    NodeDistTuple stack_buffer[VPT_MAX_HEIGHT];
+    NodeDistTuple* to_traverse = __VPT_traversal_stack(vpt, stack_buffer);
+    dist_t* leaf_dists = NULL;
+    size_t leaf_dists_capacity = 0;
+    bool success = knnlist && indices && to_traverse;
+
+    size_t n;
+    while (success && !atomic_load(&(build->failed)) &&
+           (n = atomic_fetch_add(&(build->next_node), 1)) < build->num_nodes) {
+        VPNode* node = build->nodes[n].node;
+        size_t first = build->nodes[n].first;
+        bool is_leaf = node->ulabel != 'b' && node->ulabel != 'm';
+        if (is_leaf && node->u.pointlist.size <= VPT_KNN_GRAPH_MAX_LEAF) {
+            success = __VPT_knn_graph_leaf(build, node, first, knnlist, indices, to_traverse,
+                                           &leaf_dists, &leaf_dists_capacity);
+            continue;
+        }
+
+        // A vantage point searches the whole tree, skipping only itself. So 
+        // do the items of a leaf too big for a matrix of their distances, 
+        // like a small tree that's all one leaf, or one grown by VPT_add().
+        size_t num_items = is_leaf ? node->u.pointlist.size : node->ulabel == 'b' ? 1 : 2;
+        vpt_t* items = is_leaf ? node->u.pointlist.items
+                     : node->ulabel == 'b' ? &(node->u.branch.item) : node->u.multi.items;
+        for (size_t i = 0; i < num_items; i++) {
+            VPKnnList list;
+            __VPT_knn_graph_list(build, &list, knnlist, indices);
+            __VPT_knn_search(vpt, items[i], &list, to_traverse, NULL, items + i, NULL, NULL);
+            __VPT_knn_graph_row(graph, first + i, &list);
+        }
+    }
+    if (!success) atomic_store(&(build->failed), true);
+
+    if (to_traverse) __VPT_free_traversal_stack(to_traverse, stack_buffer);
+    free(knnlist);
+    free(indices);
+    free(leaf_dists);
+    return NULL;
+}
 
 /**
+ * Frees the space of a VPKnnGraph built by VPT_knn_graph() or VPT_knn_join().
  * 
+ * @param graph The graph to destroy.
  */
+static inline void
+VPT_knn_graph_destroy(VPKnnGraph* graph) {
+    if (graph->neighbor_items != graph->items) free(graph->neighbor_items);
+    free(graph->items);
+    free(graph->indices);
+    free(graph->distances);
+    graph->items = NULL;
+    graph->neighbor_items = NULL;
+    graph->indices = NULL;
+    graph->distances = NULL;
+}
+
+// Finds the neighbors of the items of every node of build->vpt on 
+// num_threads threads, or on one per core if num_threads is 0.
 static inline bool
-VPT_all_within(VPTree* vpt, vpt_t datapoint, dist_t max_dist, VPEntry** result_space, size_t* num_results) {
-    // Take a guess and allocate a fairly large buffer to store the results.
-    WithinList all_within;
-    all_within.items = (VPEntry*)malloc(sizeof(VPEntry) * VPT_MAX_LIST_SIZE);
-    all_within.num_items = 0;
-    all_within.capacity = VPT_MAX_LIST_SIZE; 
-    
-    
-    // Assign the buffer and zero to the result space in case something 
-    // goes wrong allocating memory later (or already).
-    *result_space = all_within.items;
-    *num_results = 0;
-    if (!all_within.items) return false;
+__VPT_knn_graph_run(VPKnnGraphBuild* build, size_t num_threads, void* (*worker)(void*)) {
+    VPKnnGraph* graph = build->graph;
+    graph->items = NULL;
+    graph->neighbor_items = NULL;
+    graph->indices = NULL;
+    graph->distances = NULL;
+    if (!graph->num_items) return true;
+    if (graph->num_neighbor_items && graph->num_neighbor_items - 1 > (size_t)(vpt_idx_t)-1) return false;
+
+    graph->items = (vpt_t*)malloc(graph->num_items * sizeof(vpt_t));
+    if (graph->k) {
+        graph->indices = (vpt_idx_t*)malloc(graph->num_items * graph->k * sizeof(vpt_idx_t));
+        graph->distances = (dist_t*)malloc(graph->num_items * graph->k * sizeof(dist_t));
+    }
+    build->nodes = NULL;
+    build->num_nodes = 0;
+    build->reference_rows.nodes = NULL;
+    build->reference_rows.num_nodes = 0;
+    atomic_init(&(build->next_node), 0);
+    atomic_init(&(build->failed), false);
+    bool success = graph->items && ((graph->indices && graph->distances) || !graph->k) &&
+                   __VPT_node_rows(build->vpt, graph->items, &(build->nodes), &(build->num_nodes));
+
+    // The neighbors are found in the reference tree, so that's where their 
+    // positions are looked up. For VPT_knn_graph(), that's the same tree.
+    VPNodeRows* rows = &(build->reference_rows);
+    if (success && build->reference == build->vpt) {
+        graph->neighbor_items = graph->items;
+        rows->nodes = (VPNodeRow*)malloc(build->num_nodes * sizeof(VPNodeRow));
+        success = rows->nodes != NULL;
+        if (success) {
+            for (size_t n = 0; n < build->num_nodes; n++) rows->nodes[n] = build->nodes[n];
+            rows->num_nodes = build->num_nodes;
+        }
+    } else if (success && graph->num_neighbor_items) {
+        graph->neighbor_items = (vpt_t*)malloc(graph->num_neighbor_items * sizeof(vpt_t));
+        success = graph->neighbor_items &&
+                  __VPT_node_rows(build->reference, graph->neighbor_items, &(rows->nodes), &(rows->num_nodes));
+    }
+    if (success && rows->num_nodes) qsort(rows->nodes, rows->num_nodes, sizeof(VPNodeRow), __VPT_node_row_compare);
 
-    // max_dist is equivalent to tau from VPT_knn. It's just that we 
-    // already know tau, we don't approximate it.
+    if (success && graph->k) {
+        num_threads = __VPT_num_threads(num_threads);
+        __VPT_run_threads(min(num_threads, build->num_nodes), worker, build);
+        success = !atomic_load(&(build->failed));
+    }
 
-    // Initialize traversal stack
-    size_t to_traverse_size = 1;
-    VPNode* to_traverse[VPT_MAX_HEIGHT];
-    to_traverse[0] = vpt->root;
-    
-    // Traverse the tree by the same method used in VPT_knn()
-    VPNode* current_node;
-    while (to_traverse_size) {
-        // Pop a node from the stack and calculate the distance to it.
-        // If it falls outside of the hypersphere around 
-        current_node = to_traverse[--to_traverse_size];
+    free(build->nodes);
+    free(rows->nodes);
+    if (!success) VPT_knn_graph_destroy(graph);
+    return success;
+}
 
-        if (current_node->ulabel == 'b') {
-            // Calculate the distance between the current node and the query point.
-            dist_t dist = vpt->dist_fn(vpt->extra_data, current_node->u.branch.item, datapoint);
+/**
+ * Finds the k nearest neighbors of every item in the tree, not counting the 
+ * item itself, spread across threads. Each item's search starts with the 
+ * rest of its leaf as candidates, which saves distance calculations over 
+ * calling VPT_knn() on each item. With VPT_STATS, each search counts as a query.
+ * 
+ * The graph lists the tree's items in the order they're stored, so items 
+ * near each other in the list tend to be near each other in space. Each 
+ * neighbor is the index of an item in that same list.
+ * 
+ * @param vpt The VPTree to search. Its dist_fn must be safe to call from 
+ *            multiple threads at once.
+ * @param k The number of nearest neighbors of each item to find.
+ * @param graph Where to write the graph. Free it with VPT_knn_graph_destroy().
+ * @param num_threads The number of threads to search with, including the 
+ *                    calling one, or 0 for one per core.
+ * @return true on success, false if out of memory, or if there are too many 
+ *         items to index with vpt_idx_t. On failure, there is nothing to destroy.
+ */
+static inline bool
+VPT_knn_graph(VPTree* vpt, size_t k, VPKnnGraph* graph, size_t num_threads) {
+    graph->num_items = graph->num_neighbor_items = vpt->size;
+    graph->k = vpt->size ? min(k, vpt->size - 1) : 0;
+    VPKnnGraphBuild build;
+    build.vpt = build.reference = vpt;
+    build.graph = graph;
+    return __VPT_knn_graph_run(&build, num_threads, __VPT_knn_graph_worker);
+}
 
-            // If the distance is within the threshold, add the this node's item to the list of matches.
-            if (dist <= max_dist) {
-                // Push to list of nearest neighbors
-                /* If there's not enough space, realloc. */
-                /* If out of memory, exit with OOM flag. */
-                if (all_within.num_items == all_within.capacity) {
-                    size_t new_size = 2 * all_within.capacity;
-                    VPEntry* new_buf = (VPEntry*)realloc(all_within.items, sizeof(VPEntry) * new_size);
-                    if (!new_buf) return false;
-                    all_within.capacity = new_size;
-                    all_within.items = new_buf;
-                }
-                all_within.num_items += 1;
-                all_within.items[all_within.num_items].item = current_node->u.branch.item;
-                all_within.items[all_within.num_items].distance = dist;
+// How far from the leader an item can be, and still be close enough to a 
+// query in the group, by the triangle inequality.
+static inline dist_t
+__VPT_group_tau(VPKnnGraphBuild* build, VPQueryGroup* group) {
+    dist_t tau = 0;
+    for (size_t a = 0; a < group->num_active; a++) {
+        size_t i = group->active[a];
+        dist_t query_tau = group->lists ? group->lists[i].tau : build->eps;
+        if (query_tau >= (dist_t) DIST_MAX - group->spread[i]) return (dist_t) DIST_MAX;
+        if (query_tau + group->spread[i] > tau) tau = query_tau + group->spread[i];
+    }
+    return tau;
+}
+
+// The leader of a group has found an item at offset among the items of node, 
+// leader_dist away from it. Hands the item to the queries it could be close enough to, by the triangle inequality, 
+// and returns the new tau of the group. Once the leader has its k neighbors, 
+// the queries much farther from it than they are, which would make the group 
+// search too much of the tree, are dropped. Returns DIST_MAX if the visitor 
+// stops the join.
+static inline dist_t
+__VPT_group_add(VPKnnGraphBuild* build, VPQueryGroup* group, vpt_t item, dist_t leader_dist,
+                VPNode* node, size_t offset) {
+    VPTree* vpt = build->vpt;
+    VPKnnList* lists = group->lists;
+    for (size_t a = 0; a < group->num_active; a++) {
+        size_t i = group->active[a];
+        dist_t query_tau = lists ? lists[i].tau : build->eps;
+        if (__VPT_dist_lower_bound(leader_dist, group->spread[i]) > query_tau) continue;
+        dist_t dist = leader_dist;
+        if (i) {
+            dist = vpt->dist_fn(vpt->extra_data, group->queries[i], item);
+            group->dist_calls++;
+        }
+        if (!lists) {
+            if (dist <= query_tau && !build->visitor(build->user_data, group->queries[i], item, dist)) {
+                atomic_store(&(build->stopped), true);
+                return (dist_t) DIST_MAX;
             }
-            
-            // Push the branches of the tree that could still contain nearest 
-            // neighbors onto the stack to be processed.
-            if (dist < current_node->u.branch.radius) {
-                if (dist - max_dist <= current_node->u.branch.radius)
-                    to_traverse[to_traverse_size++] = current_node->u.branch.left;
-                if (dist + max_dist >= current_node->u.branch.radius)
-                    to_traverse[to_traverse_size++] = current_node->u.branch.right;
+        } else if (dist < query_tau) {
+            __VPT_knnlist_add_found(lists + i, item, dist, node, offset);
+        }
+    }
 
+    if (lists && lists[0].size == lists[0].k) {
+        for (size_t a = 1; a < group->num_active; a++) {
+            size_t i = group->active[a];
+            if (group->spread[i] <= VPT_JOIN_GROUP_SPREAD * lists[0].tau) continue;
+            group->active[a--] = group->active[--group->num_active];
+            group->active[group->num_active] = i;
+        }
+    }
+    return __VPT_group_tau(build, group);
+}
+
+// The same traversal as __VPT_knn_search(), for the leader of a group, but 
+// with the tau of the whole group. Returns false if the visitor stops the join.
+static inline bool
+__VPT_group_search(VPKnnGraphBuild* build, VPQueryGroup* group) {
+    __VPT_STATS_BEGIN;
+    VPTree* vpt = build->vpt;
+    vpt_t leader = group->queries[0];
+    dist_t tau = __VPT_group_tau(build, group);
+    group->dist_calls = 0;
+
+    NodeDistTuple* to_traverse = group->to_traverse;
+    size_t to_traverse_size = 1;
+    to_traverse[0].node = build->reference->root;
+    to_traverse[0].dist = 0;
+    while (to_traverse_size && !atomic_load_explicit(&(build->stopped), memory_order_relaxed)) {
+        NodeDistTuple popped = to_traverse[--to_traverse_size];
+        VPNode* current_node = popped.node;
+
+        if (current_node->ulabel == 'b') {
+            VPBranch* branch = &(current_node->u.branch);
+            dist_t dist = vpt->dist_fn(vpt->extra_data, leader, branch->item);
+            __VPT_STAT(dist_calls, 1);
+            __VPT_STAT(branches_visited, 1);
+            __VPT_STAT(subtrees_pruned, 2);
+            if (dist <= tau) tau = __VPT_group_add(build, group, branch->item, dist, current_node, 0);
+
+            bool search_left = dist - tau <= branch->radius && dist + tau >= branch->left_min;
+            bool search_right = dist + tau >= branch->right_min && dist - tau <= branch->right_max;
+            if (dist > branch->radius) {
+                if (search_left) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->left, dist};
+                if (search_right) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->right, dist};
             } else {
-                if (dist + max_dist >= current_node->u.branch.radius)
-                    to_traverse[to_traverse_size++] = current_node->u.branch.right;
-                if (dist - max_dist <= current_node->u.branch.radius)
-                    to_traverse[to_traverse_size++] = current_node->u.branch.left;
+                if (search_right) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->right, dist};
+                if (search_left) to_traverse[to_traverse_size++] = (NodeDistTuple){branch->left, dist};
             }
-
-        } 
-        
-        // If the VPNode popped off the traversal stack is a list
-        else {
+            __VPT_STAT_STACK(to_traverse_size);
+        } else if (current_node->ulabel == 'm') {
+            VPMulti* multi = &(current_node->u.multi);
+            dist_t dists[2];
+            for (size_t v = 0; v < 2; v++) {
+                dists[v] = vpt->dist_fn(vpt->extra_data, leader, multi->items[v]);
+                if (dists[v] <= tau) tau = __VPT_group_add(build, group, multi->items[v], dists[v], current_node, v);
+            }
+            __VPT_STAT(dist_calls, 2);
+            __VPT_STAT(branches_visited, 1);
+
+            size_t num_children = multi->fanout * multi->fanout;
+            __VPT_STAT(subtrees_pruned, num_children);
+            for (int contains_query = 0; contains_query < 2; contains_query++) {
+                for (size_t c = 0; c < num_children; c++) {
+                    dist_t bound = __VPT_multi_lower_bound(multi->children + c, dists[0], dists[1]);
+                    if (bound <= tau && (bound == 0) == contains_query)
+                        to_traverse[to_traverse_size++] = (NodeDistTuple){multi->children[c].node, dists[1]};
+                }
+            }
+            __VPT_STAT_STACK(to_traverse_size);
+        } else {
             size_t vplist_size = current_node->u.pointlist.size;
             vpt_t* vplist = current_node->u.pointlist.items;
-
-            // For each item in the list, calculate the distance between the datapoint and the item.
-            // If the item is within max_dist, add it to the list of matches.
+            dist_t* vpdists = current_node->u.pointlist.distances;
+            __VPT_STAT(leaves_scanned, 1);
             for (size_t i = 0; i < vplist_size; i++) {
+                if (vpdists && __VPT_dist_lower_bound(popped.dist, vpdists[i]) > tau) continue;
+                dist_t dist = vpt->dist_fn(vpt->extra_data, leader, vplist[i]);
+                __VPT_STAT(dist_calls, 1);
+                if (dist <= tau) tau = __VPT_group_add(build, group, vplist[i], dist, current_node, i);
+            }
+        }
+    }
+    __VPT_STAT(dist_calls, group->dist_calls);
+    __VPT_STATS_END(build->reference);
+    return !atomic_load_explicit(&(build->stopped), memory_order_relaxed);
+}
 
-                dist_t dist = vpt->dist_fn(vpt->extra_data, vplist[i], datapoint);
+// Finds the neighbors in the reference tree of queries close to each other, 
+// whose results start at row first of the graph, if there is one. They're 
+// searched for together, so mostly only the leader's distances are 
+// calculated, and the others' only when the triangle inequality can't rule 
+// them out from the leader's. Returns false if out of memory, or if the 
+// visitor stops the join.
+static inline bool
+__VPT_group_join(VPKnnGraphBuild* build, vpt_t* queries, size_t num_queries, size_t first, VPQueryGroup* group) {
+    VPTree* vpt = build->vpt;
+    VPKnnGraph* graph = build->graph;
+    size_t buffer_size = graph->k + 1;
+    if (!num_queries) return true;
+    if (num_queries > group->capacity) {
+        VPKnnList* new_lists = (VPKnnList*)realloc(group->lists, num_queries * sizeof(VPKnnList));
+        if (new_lists) group->lists = new_lists;
+        VPEntry* new_buffers = (VPEntry*)realloc(group->buffers, num_queries * buffer_size * sizeof(VPEntry));
+        if (new_buffers) group->buffers = new_buffers;
+        vpt_idx_t* new_indices = (vpt_idx_t*)realloc(group->indices, num_queries * buffer_size * sizeof(vpt_idx_t));
+        if (new_indices) group->indices = new_indices;
+        dist_t* new_spread = (dist_t*)realloc(group->spread, num_queries * sizeof(dist_t));
+        if (new_spread) group->spread = new_spread;
+        size_t* new_active = (size_t*)realloc(group->active, num_queries * sizeof(size_t));
+        if (new_active) group->active = new_active;
+        if (!new_lists || !new_buffers || !new_indices || !new_spread || !new_active) {
+            atomic_store(&(build->failed), true);
+            return false;
+        }
+        group->capacity = num_queries;
+    }
 
-                if (dist <= max_dist) {
-                    // Push to list of nearest neighbors
-                    /* If there's not enough space, realloc. */
-                    /* If out of memory, exit with OOM flag. */
-                    if (all_within.num_items == all_within.capacity) {
-                        size_t new_size = 2 * all_within.capacity;
-                        VPEntry* new_buf = (VPEntry*)realloc(all_within.items, sizeof(VPEntry) * new_size);
-                        if (!new_buf) return false;
-                        all_within.capacity = new_size;
-                        all_within.items = new_buf;
-                    }
-                    all_within.num_items += 1;
-                    all_within.items[all_within.num_items].item = vplist[i];
-                    all_within.items[all_within.num_items].distance = dist;
-                }
-            }
+    // Range queries know how far they search from the start, so the ones 
+    // too far from the leader are dropped right away.
+    VPKnnList* lists = group->lists;
+    group->queries = queries;
+    group->num_queries = num_queries;
+    group->num_active = 0;
+    for (size_t i = 0; i < num_queries; i++) {
+        if (graph->k) {
+            __VPT_knn_graph_list(build, lists + i, group->buffers + i * buffer_size,
+                                 group->indices + i * buffer_size);
+        }
+        group->spread[i] = i ? vpt->dist_fn(vpt->extra_data, queries[0], queries[i]) : 0;
+        if (graph->k || group->spread[i] <= VPT_JOIN_GROUP_SPREAD * build->eps)
+            group->active[group->num_active++] = i;
+    }
+    size_t num_grouped = group->num_active;
+    for (size_t i = 0, a = num_grouped; i < num_queries; i++) {
+        if (group->spread[i] > VPT_JOIN_GROUP_SPREAD * build->eps && !graph->k) group->active[a++] = i;
+    }
+    if (!graph->k) group->lists = NULL;
+    bool success = __VPT_group_search(build, group);
+
+    // Then the dropped queries each lead a group of their own.
+    num_grouped = group->num_active;
+    size_t* dropped = group->active + num_grouped;
+    group->spread[0] = 0;
+    group->active[0] = 0;
+    for (size_t d = 0; success && d < num_queries - num_grouped; d++) {
+        size_t i = dropped[d];
+        if (graph->k) {
+            __VPT_knn_graph_list(build, lists + i, group->buffers + i * buffer_size,
+                                 group->indices + i * buffer_size);
         }
+        group->queries = queries + i;
+        group->lists = graph->k ? lists + i : NULL;
+        group->num_active = 1;
+        success = __VPT_group_search(build, group);
     }
+    group->lists = lists;
 
-    // The buffer of matches is already assigned to the result space, but 
-    // we do need to update the count.
-    *num_results = all_within.num_items;
-    return true;
+    for (size_t i = 0; graph->k && i < num_queries; i++) __VPT_knn_graph_row(graph, first + i, lists + i);
+    return success;
+}
+
+static void*
+__VPT_group_worker(void* arg) {
+    VPKnnGraphBuild* build = (VPKnnGraphBuild*)arg;
+
+    // Each thread searches in its own space, which it reuses for every group.
+    VPQueryGroup group;
+    group.lists = NULL;
+    group.buffers = NULL;
+    group.indices = NULL;
+    group.spread = NULL;
+    group.active = NULL;
+    group.capacity = 0;
+    NodeDistTuple stack_buffer[VPT_MAX_HEIGHT];
+    group.to_traverse = __VPT_traversal_stack(build->reference, stack_buffer);
+    if (!group.to_traverse) atomic_store(&(build->failed), true);
+
+    // The items of a leaf are close together, so they're searched for as a 
+    // group. The vantage points of a branch aren't, so they go on their own.
+    bool success = group.to_traverse != NULL;
+    size_t n;
+    while (success && !atomic_load(&(build->failed)) && !atomic_load(&(build->stopped)) &&
+           (n = atomic_fetch_add(&(build->next_node), 1)) < build->num_nodes) {
+        VPNode* node = build->nodes[n].node;
+        size_t first = build->nodes[n].first;
+        if (node->ulabel == 'b') {
+            success = __VPT_group_join(build, &(node->u.branch.item), 1, first, &group);
+        } else if (node->ulabel == 'm') {
+            success = __VPT_group_join(build, node->u.multi.items, 1, first, &group) &&
+                      __VPT_group_join(build, node->u.multi.items + 1, 1, first + 1, &group);
+        } else {
+            success = __VPT_group_join(build, node->u.pointlist.items, node->u.pointlist.size, first, &group);
+        }
+    }
+
+    if (group.to_traverse) __VPT_free_traversal_stack(group.to_traverse, stack_buffer);
+    free(group.lists);
+    free(group.buffers);
+    free(group.indices);
+    free(group.spread);
+    free(group.active);
+    return NULL;
 }
 
+/**
+ * Finds the k nearest neighbors in the reference tree of every item in the 
+ * query tree, spread across threads. Rather than searching the reference 
+ * tree once for each query, the queries of each leaf of the query tree are 
+ * searched for together, in one walk of the reference tree, which is pruned 
+ * by the shells of its subtrees and by how far apart the queries are. Each 
+ * distance calculated from the first query rules out most of the others by 
+ * the triangle inequality, so the closer together the queries, the fewer 
+ * distances are calculated. Queries too far from the rest of their leaf to 
+ * gain from it are searched for on their own. With VPT_STATS, each walk 
+ * counts as a query of the reference tree.
+ * 
+ * The graph lists the query tree's items in the order they're stored, the 
+ * same way as VPT_knn_graph() does. Each neighbor is the index of an item 
+ * in neighbor_items, which lists the reference tree's items the same way.
+ * 
+ * @param queries The VPTree of query items.
+ * @param reference The VPTree to search for them. Both trees must have the 
+ *                  same distance function, which must be safe to call from 
+ *                  multiple threads at once. The query tree's is called.
+ * @param k The number of nearest neighbors of each query to find.
+ * @param graph Where to write the neighbors. Free it with VPT_knn_graph_destroy().
+ * @param num_threads The number of threads to search with, including the 
+ *                    calling one, or 0 for one per core.
+ * @return true on success, false if out of memory, or if there are too many 
+ *         reference items to index with vpt_idx_t. On failure, there is 
+ *         nothing to destroy.
+ */
+static inline bool
+VPT_knn_join(VPTree* queries, VPTree* reference, size_t k, VPKnnGraph* graph, size_t num_threads) {
+    graph->num_items = queries->size;
+    graph->num_neighbor_items = reference->size;
+    graph->k = min(k, reference->size);
+    VPKnnGraphBuild build;
+    build.vpt = queries;
+    build.reference = reference;
+    build.graph = graph;
+    build.eps = 0;
+    atomic_init(&(build.stopped), false);
+    return __VPT_knn_graph_run(&build, num_threads, __VPT_group_worker);
+}
+
+/**
+ * Finds every pair of an item in the query tree and an item in the reference 
+ * tree within eps of each other, spread across threads. The queries of each 
+ * leaf of the query tree are searched for together, the same way as 
+ * VPT_knn_join() does, except that the ones farther than a fraction of eps 
+ * from the first are searched for on their own from the start. The pairs 
+ * come in no particular order. With VPT_STATS, each walk counts as a query 
+ * of the reference tree.
+ * 
+ * @param queries The VPTree of query items.
+ * @param reference The VPTree to search for them. Both trees must have the 
+ *                  same distance function, which must be safe to call from 
+ *                  multiple threads at once. The query tree's is called.
+ * @param eps The distance to find pairs within, inclusive.
+ * @param visitor Called with user_data, the query item, the reference item, 
+ *                and the distance between them, for each pair. It's called 
+ *                from multiple threads at once, unless num_threads is 1. 
+ *                Returns whether to keep going.
+ * @param user_data Passed through to the visitor.
+ * @param num_threads The number of threads to search with, including the 
+ *                    calling one, or 0 for one per core.
+ * @return false if out of memory, true otherwise, including when the visitor 
+ *         stops the join. On failure, some of the pairs may not have been found.
+ */
+static inline bool
+VPT_join_within(VPTree* queries, VPTree* reference, dist_t eps, VPPairVisitor visitor, void* user_data,
+                size_t num_threads) {
+    if (!queries->size || !reference->size) return true;
+
+    VPKnnGraph graph;
+    graph.num_items = queries->size;
+    graph.k = 0;
+    VPKnnGraphBuild build;
+    build.vpt = queries;
+    build.reference = reference;
+    build.graph = &graph;
+    build.nodes = NULL;
+    build.num_nodes = 0;
+    build.reference_rows.nodes = NULL;
+    build.reference_rows.num_nodes = 0;
+    build.eps = eps;
+    build.visitor = visitor;
+    build.user_data = user_data;
+    atomic_init(&(build.next_node), 0);
+    atomic_init(&(build.failed), false);
+    atomic_init(&(build.stopped), false);
+
+    bool success = __VPT_node_rows(queries, NULL, &(build.nodes), &(build.num_nodes));
+    if (success) {
+        num_threads = __VPT_num_threads(num_threads);
+        __VPT_run_threads(min(num_threads, build.num_nodes), __VPT_group_worker, &build);
+        success = !atomic_load(&(build.failed));
+    }
+
+    free(build.nodes);
+    return success;
+}
 
 /**
  * Adds a single element to an already constructed VPTree. 
@@ -979,21 +4806,31 @@ VPT_add(VPTree* vpt, vpt_t to_add) {
  */
 static inline bool
 VPT_add_rebuild(VPTree* vpt, vpt_t* to_add, size_t num_to_add) {
-    // Grab the items out of the previous tree
+    // Grab the items out of the previous tree, keeping the cache for the new one
     size_t num_items = vpt->size;
+    VPCache* cache = vpt->cache;
+    vpt->cache = NULL;
     vpt_t* items = VPT_teardown(vpt);   
-    if (!items) return false;
+    if (!items) {
+        __VPT_cache_free(cache);
+        return false;
+    }
 
     // Reallocate the buffer to make space, then append the new items to the buffer.
     vpt_t* new_items = (vpt_t*)realloc(items, (num_items+num_to_add) * sizeof(vpt_t));
-    if (!new_items) return false;
+    if (!new_items) {
+        __VPT_cache_free(cache);
+        return false;
+    }
     items = new_items;
     for (size_t i = num_items, j = 0; i < (num_items + num_to_add); i++, j++) {
         items[i] = to_add[j];
     }
 
     // Rebuild the tree using the buffer.
-    bool success = VPT_build(vpt, items, (num_items+num_to_add), vpt->dist_fn, vpt->extra_data);
+    bool success = VPT_build_config(vpt, items, (num_items+num_to_add), vpt->dist_fn, vpt->extra_data, &(vpt->config));
+    vpt->cache = cache;
+    VPT_cache_clear(vpt);
     if (!success) return false;
     
 